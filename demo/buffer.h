@@ -1,6 +1,7 @@
 #ifndef BUFFER_H_GUARD
 #define BUFFER_H_GUARD
 #include <SDL/SDL.h>
+#include <vector>
 #include "myassert.h"
 #ifdef DEBUG
 #include <stdexcept>
@@ -169,6 +170,94 @@ private:
 	unsigned int alloc_size; //how much is allocated
 	T* data;
 };
+
+/* Arena of fixed size chunks for lists of T that are all thrown away at once,
+   like the per-frame tile bins. Lists grow a chunk at a time, and Reset() just
+   rewinds the arena. Chunks are kept for the next frame, but when a frame uses
+   less than half of them, the unused ones are released. */
+template<typename T, int N>
+class ChunkArena {
+public:
+	struct Chunk {
+		T items[N];
+		Chunk* next;
+	};
+	ChunkArena() : used(0) {}
+	~ChunkArena() {
+		for(size_t i = 0; i < chunks.size(); ++i)
+			delete chunks[i];
+	}
+	Chunk* Alloc() {
+		if(used == chunks.size())
+			chunks.push_back(new Chunk);
+		Chunk* c = chunks[used++];
+		c->next = 0;
+		return c;
+	}
+	void Reset() {
+		if(chunks.size() > 2 * used + 64) {
+			for(size_t i = 2 * used; i < chunks.size(); ++i)
+				delete chunks[i];
+			chunks.resize(2 * used);
+		}
+		used = 0;
+	}
+	inline size_t Used() const {
+		return used;
+	}
+private:
+	std::vector<Chunk*> chunks;
+	size_t used;
+};
+
+/* A list of T living in a ChunkArena. Only Push and in-order iteration */
+template<typename T, int N>
+struct ChunkList {
+	typedef typename ChunkArena<T, N>::Chunk Chunk;
+	ChunkList() : head(0), tail(0), count(0) {}
+	void Clear() {
+		head = tail = 0;
+		count = 0;
+	}
+	inline void Push(const T& t, ChunkArena<T, N>& arena) {
+		const int slot = count % N;
+		if(slot == 0) {
+			Chunk* c = arena.Alloc();
+			if(tail)
+				tail->next = c;
+			else
+				head = c;
+			tail = c;
+		}
+		tail->items[slot] = t;
+		++count;
+	}
+	struct Iterator {
+		Iterator(Chunk* c, int n) : chunk(c), slot(0), left(n) {}
+		inline bool Valid() const {
+			return left > 0;
+		}
+		inline T& Get() const {
+			return chunk->items[slot];
+		}
+		inline void Next() {
+			--left;
+			if(++slot == N) {
+				chunk = chunk->next;
+				slot = 0;
+			}
+		}
+		Chunk* chunk;
+		int slot;
+		int left;
+	};
+	Iterator Begin() const {
+		return Iterator(head, count);
+	}
+	Chunk* head;
+	Chunk* tail;
+	int count;
+};
 //          x x x
 //        x
 //0 1 2 3 4 5 6   (7)
@@ -1,201 +1,193 @@
 #include <vector>
 #include <algorithm>
-#include <cstdio>
 #include <linealg.h>
 #include "clipplane.h"
-#include "vertexdata.h"
-
-/*
-	wc_vertices
-	wc_tcoords0
-	wc_tcoords1
-	wc_normals
-	wc_colors
-*/
-void clip_triangle(Vector4f plane, unsigned int flags)
+
+//Vertex positions plus up to four attribute streams
+const int maxStreams = 5;
+//near, far, w > 0 and the four guard band planes
+const int numPlanes = 7;
+//Every plane adds at most one vertex to a convex polygon
+const int maxPolyVerts = 3 + numPlanes;
+
+//Keeps w away from 0 for the perspective divide
+const float wEpsilon = 1.0f / 1024.0f;
+//Guard band beyond each screen edge. The binner sets up the edge functions of the
+//28.4 fixed point vertices in 64 bits, but the blitters step them across a tile
+//in 32 bits. With vertices within 16384 pixels of the screen center, an edge
+//changes by at most 2^29 over the largest (32x32) tile, which leaves room for the
+//values SetupTile clamps to 2^30. This band stays within that on screens up to
+//16384 pixels wide or high.
+const float guardBandPixels = 8192.0f;
+
+/* Plane in clip space, v is inside when dot(n, v) + d >= 0 */
+struct ClipPlane {
+	VectorPOD4f n;
+	float d;
+};
+
+/* Vertex of the polygon being clipped, with all the streams in use */
+struct ClipVertex {
+	VectorPOD4f s[maxStreams];
+};
+
+//Clipped triangles are written here, and drawn instead of the input streams.
+//Capacity is kept between frames, so clipping doesn't allocate once warmed up.
+static std::vector<VectorPOD4f> wc_clipStreams[maxStreams];
+
+static inline float PlaneDistance(const ClipPlane& p, const VectorPOD4f& v)
 {
-#if 0
-	unsigned int edge0, edge1;
-	unsigned int tri;
-
-	size_t vertexListSize = wc_vertices->size();
-
-	for(tri=0; tri<vertexListSize; tri+=3) {
-		std::vector<Vector4f> polygon; /* outputted vertices */
-		std::vector<Vector4f> polygon_tcoords0; /* interpolants */
-		std::vector<Vector4f> polygon_tcoords1;
-		std::vector<Vector4f> polygon_normals;
-		std::vector<Vector4f> polygon_colors;
-
-		for(edge0=tri+2, edge1=tri; edge1 < tri+3; edge0 = edge1++) {
-			Vector4f point_current, point_next, tcoord0_current,
-			         tcoord0_next, tcoord1_current, tcoord1_next, normal_current,
-			         normal_next, color_current, color_next;
-
-			point_current  = (*wc_vertices)[edge0];
-			point_next     = (*wc_vertices)[edge1];
-
-			if(flags & SR_TEXCOORD0) {
-				tcoord0_current = (*wc_tcoords0)[edge0];
-				tcoord0_next    = (*wc_tcoords0)[edge1];
-			}
-			if(flags & SR_TEXCOORD1) {
-				tcoord1_current = (*wc_tcoords1)[edge0];
-				tcoord1_next    = (*wc_tcoords1)[edge1];
-			}
-			if(flags & SR_LIGHTING) {
-				normal_current = (*wc_normals)[edge0];
-				normal_next    = (*wc_normals)[edge1];
-			}
-			if(flags & SR_COLOR) {
-				color_current = (*wc_colors)[edge0];
-				color_next    = (*wc_colors)[edge1];
-			}
+	return p.n.x*v.x + p.n.y*v.y + p.n.z*v.z + p.n.w*v.w + p.d;
+}
 
-			/* point.w is positive*/
-			/* v.n - d = 0 */
-			//float wInv_current = 1.0f / point_current.w;
-			//float wInv_next = 1.0f / point_next.w;
-
-			float dot0 = dot(point_current, plane) + point_current.w * plane.w;
-			float dot1 = dot(point_next,    plane) + point_next.w    * plane.w;
-
-			bool inside0 = dot0 > 0.0f;
-			bool inside1 = dot1 > 0.0f;
-
-			/* If start is inside, output it */
-			if(inside0) {
-				polygon.push_back(point_current);
-				if(flags & SR_TEXCOORD0)
-					polygon_tcoords0.push_back(tcoord0_current);
-				if(flags & SR_TEXCOORD1)
-					polygon_tcoords1.push_back(tcoord1_current);
-				if(flags & SR_LIGHTING)
-					polygon_normals.push_back(normal_current);
-				if(flags & SR_COLOR)
-					polygon_colors.push_back(color_current);
-			}
-			if(inside0 != inside1) {
-				/* We're clipping an edge */
-				float t=0.0f;
-				float diff = 0.0f;
-				/* swap vertices  if point0 is outside and point1 is inside*/
-				if(inside0 == false) {
-					//std::swap(wInv_current, wInv_next);
-					std::swap(point_current, point_next);
-					std::swap(dot0, dot1);
-
-					//add all data cases
-					if(flags & SR_TEXCOORD0)
-						std::swap(tcoord0_current, tcoord0_next);
-					if(flags & SR_TEXCOORD1)
-						std::swap(tcoord1_current, tcoord1_next);
-					if(flags & SR_LIGHTING)
-						std::swap(normal_current, normal_next);
-					if(flags & SR_COLOR)
-						std::swap(color_current, color_next);
-				}
-				diff = dot0 - dot1;
-				//const float eps = 1.0f / 4096.0f;
-
-				if(std::abs(diff) > 1e-7f) //1e-7
-					t = dot0 / diff;
-				if(std::abs(t) < 0.001f) t = 0.0f;
-
-				Vector4f offsetPoint = (point_next - point_current) * t;
-				Vector4f clipPoint = point_current + offsetPoint;
-				clipPoint.w = point_current.w + (point_next.w - point_current.w) * t;
-				polygon.push_back(clipPoint);
-
-				if(flags & SR_TEXCOORD0) {
-					Vector4f offsetTCoord = (tcoord0_next - tcoord0_current) * t;
-					Vector4f clipTCoord = tcoord0_current + offsetTCoord;
-					polygon_tcoords0.push_back(clipTCoord);
-				}
-				if(flags & SR_TEXCOORD1) {
-					Vector4f offsetTCoord = (tcoord1_next - tcoord1_current) * t;
-					Vector4f clipTCoord = tcoord1_current + offsetTCoord;
-					polygon_tcoords1.push_back(clipTCoord);
-				}
-				if(flags & SR_LIGHTING) {
-					Vector4f offsetNormal = (normal_next - normal_current) * t;
-					Vector4f clipNormal = normal_current + offsetNormal;
-					polygon_normals.push_back(clipNormal);
-				}
-				if(flags & SR_COLOR) {
-					Vector4f offsetColor = (color_next - color_current) * t;
-					Vector4f clipColor = color_current + offsetColor;
-					polygon_colors.push_back(clipColor);
-				}
-			}
-		}
+/* One bit for every plane v is outside of */
+static inline unsigned int Outcode(const ClipPlane* planes, const VectorPOD4f& v)
+{
+	unsigned int code = 0;
+	for(int i = 0; i < numPlanes; ++i) {
+		if(PlaneDistance(planes[i], v) < 0.0f)
+			code |= 1 << i;
+	}
+	return code;
+}
 
-		/* Split the resulting polygon into triangles.
-		   TODO: Turn this into a triangle strip pattern to avoid narrow triangles.*/
+static inline VectorPOD4f Lerp(const VectorPOD4f& a, const VectorPOD4f& b, float t)
+{
+	VectorPOD4f r = {a.x + (b.x - a.x) * t,
+	                 a.y + (b.y - a.y) * t,
+	                 a.z + (b.z - a.z) * t,
+	                 a.w + (b.w - a.w) * t};
+	return r;
+}
 
-		size_t vcount = polygon.size();
+/* Sutherland-Hodgman against one plane. Returns the vertex count of the result */
+static int ClipPolygon(const ClipPlane& plane, const ClipVertex* in, int count,
+                       ClipVertex* out, int numStreams)
+{
+	int outCount = 0;
+	int prev = count - 1;
+	float dPrev = PlaneDistance(plane, in[prev].s[0]);
+	for(int cur = 0; cur < count; prev = cur++) {
+		const float dCur = PlaneDistance(plane, in[cur].s[0]);
+		if((dPrev >= 0.0f) != (dCur >= 0.0f)) {
+			//Always interpolate from the inside vertex, so the two triangles
+			//sharing this edge get the exact same new vertex
+			const ClipVertex& a = dPrev >= 0.0f ? in[prev] : in[cur];
+			const ClipVertex& b = dPrev >= 0.0f ? in[cur] : in[prev];
+			const float da = dPrev >= 0.0f ? dPrev : dCur;
+			const float db = dPrev >= 0.0f ? dCur : dPrev;
+			const float t = da / (da - db);
+			for(int s = 0; s < numStreams; ++s)
+				out[outCount].s[s] = Lerp(a.s[s], b.s[s], t);
+			++outCount;
+		}
+		if(dCur >= 0.0f)
+			out[outCount++] = in[cur];
+		dPrev = dCur;
+	}
+	return outCount;
+}
 
-		if(vcount < 3)
-			continue;
+/* The planes for a width x height screen */
+static void MakePlanes(ClipPlane* planes, int width, int height)
+{
+	//Guard band in NDC, the same number of pixels around every side of the screen.
+	//Geometry between the screen and the guard band is left for the rasterizer
+	//to reject, so x and y clipping is rare.
+	const float gx = 1.0f + guardBandPixels / ((float)width * 0.5f);
+	const float gy = 1.0f + guardBandPixels / ((float)height * 0.5f);
+
+	const ClipPlane p[numPlanes] = {
+		{{0.0f, 0.0f, 1.0f, 1.0f}, 0.0f}, //near, z >= -w
+		{{0.0f, 0.0f, -1.0f, 1.0f}, 0.0f}, //far, z <= w
+		{{0.0f, 0.0f, 0.0f, 1.0f}, -wEpsilon}, //w >= eps
+		{{1.0f, 0.0f, 0.0f, gx}, 0.0f}, //left
+		{{-1.0f, 0.0f, 0.0f, gx}, 0.0f}, //right
+		{{0.0f, 1.0f, 0.0f, gy}, 0.0f}, //bottom
+		{{0.0f, -1.0f, 0.0f, gy}, 0.0f}, //top
+	};
+	std::copy(p, p + numPlanes, planes);
+}
 
-		for(int p=1; p<vcount-1; ++p) {
+void clip_outcodes(const VectorPOD4f* vertices, size_t count, int width, int height, unsigned char* codes)
+{
+	ClipPlane planes[numPlanes];
+	MakePlanes(planes, width, height);
+	for(size_t i = 0; i < count; ++i)
+		codes[i] = (unsigned char)Outcode(planes, vertices[i]);
+}
+
+size_t clip_triangles(const VectorPOD4f** streams, int numStreams, size_t vertexCount, int width, int height)
+{
+	ClipPlane planes[numPlanes];
+	MakePlanes(planes, width, height);
+
+	const VectorPOD4f* vertices = streams[0];
+	const size_t numVertices = vertexCount - vertexCount % 3;
+
+	//Most frames have nothing to clip, leave the streams alone then
+	size_t first = 0;
+	for(; first < numVertices; first += 3) {
+		if(Outcode(planes, vertices[first+0]) |
+		   Outcode(planes, vertices[first+1]) |
+		   Outcode(planes, vertices[first+2]))
+			break;
+	}
+	if(first >= numVertices)
+		return numVertices;
 
-			polygon.push_back(polygon[0]);
-			polygon.push_back(polygon[p]);
-			polygon.push_back(polygon[p+1]);
+	for(int s = 0; s < numStreams; ++s) {
+		wc_clipStreams[s].clear();
+		wc_clipStreams[s].insert(wc_clipStreams[s].end(), streams[s], streams[s] + first);
+	}
 
-			if(flags & SR_TEXCOORD0) {
-				polygon_tcoords0.push_back(polygon_tcoords0[0]);
-				polygon_tcoords0.push_back(polygon_tcoords0[p]);
-				polygon_tcoords0.push_back(polygon_tcoords0[p+1]);
-			}
-			if(flags & SR_TEXCOORD1) {
-				polygon_tcoords1.push_back(polygon_tcoords1[0]);
-				polygon_tcoords1.push_back(polygon_tcoords1[p]);
-				polygon_tcoords1.push_back(polygon_tcoords1[p+1]);
-			}
-			if(flags & SR_LIGHTING) {
-				polygon_normals.push_back(polygon_normals[0]);
-				polygon_normals.push_back(polygon_normals[p]);
-				polygon_normals.push_back(polygon_normals[p+1]);
-			}
-			if(flags & SR_COLOR) {
-				polygon_colors.push_back(polygon_colors[0]);
-				polygon_colors.push_back(polygon_colors[p]);
-				polygon_colors.push_back(polygon_colors[p+1]);
+	ClipVertex polyA[maxPolyVerts];
+	ClipVertex polyB[maxPolyVerts];
+	for(size_t i = first; i < numVertices; i += 3) {
+		const unsigned int c0 = Outcode(planes, vertices[i+0]);
+		const unsigned int c1 = Outcode(planes, vertices[i+1]);
+		const unsigned int c2 = Outcode(planes, vertices[i+2]);
+
+		//Completely inside, copy as is
+		if(!(c0 | c1 | c2)) {
+			for(int s = 0; s < numStreams; ++s) {
+				const VectorPOD4f* src = streams[s] + i;
+				wc_clipStreams[s].insert(wc_clipStreams[s].end(), src, src + 3);
 			}
+			continue;
 		}
+		//Completely outside one of the planes
+		if(c0 & c1 & c2)
+			continue;
 
-		wc_vertices->reserve(wc_vertices->size() + (polygon.size() - vcount));
-		std::copy(polygon.begin() + vcount, polygon.end(), std::back_inserter(*wc_vertices));
-
-		if(flags & SR_TEXCOORD0) {
-			wc_tcoords0->reserve(wc_tcoords0->size() + (polygon_tcoords0.size() - vcount));
-			std::copy(polygon_tcoords0.begin() + vcount, polygon_tcoords0.end(), std::back_inserter(*wc_tcoords0));
+		for(int s = 0; s < numStreams; ++s) {
+			polyA[0].s[s] = streams[s][i+0];
+			polyA[1].s[s] = streams[s][i+1];
+			polyA[2].s[s] = streams[s][i+2];
 		}
-		if(flags & SR_TEXCOORD1) {
-			wc_tcoords1->reserve(wc_tcoords1->size() + (polygon_tcoords1.size() - vcount));
-			std::copy(polygon_tcoords1.begin() + vcount, polygon_tcoords1.end(), std::back_inserter(*wc_tcoords1));
+		ClipVertex* in = polyA;
+		ClipVertex* out = polyB;
+		int count = 3;
+		const unsigned int crossed = c0 | c1 | c2;
+		for(int p = 0; p < numPlanes && count >= 3; ++p) {
+			if(!(crossed & (1 << p)))
+				continue;
+			count = ClipPolygon(planes[p], in, count, out, numStreams);
+			std::swap(in, out);
 		}
-		if(flags & SR_LIGHTING) {
-			wc_normals->reserve(wc_normals->size() + (polygon_normals.size() - vcount));
-			std::copy(polygon_normals.begin() + vcount, polygon_normals.end(), std::back_inserter(*wc_normals));
-		}
-		if(flags & SR_COLOR) {
-			wc_colors->reserve(wc_colors->size() + (polygon_colors.size() - vcount));
-			std::copy(polygon_colors.begin() + vcount, polygon_colors.end(), std::back_inserter(*wc_colors));
+
+		//Triangulate as a fan, which keeps the winding
+		for(int v = 1; v < count - 1; ++v) {
+			for(int s = 0; s < numStreams; ++s) {
+				wc_clipStreams[s].push_back(in[0].s[s]);
+				wc_clipStreams[s].push_back(in[v].s[s]);
+				wc_clipStreams[s].push_back(in[v+1].s[s]);
+			}
 		}
 	}
-	wc_vertices->erase(wc_vertices->begin(), wc_vertices->begin() + vertexListSize);
-	if(flags & SR_TEXCOORD0)
-		wc_tcoords0->erase(wc_tcoords0->begin(), wc_tcoords0->begin() + vertexListSize);
-	if(flags & SR_TEXCOORD1)
-		wc_tcoords1->erase(wc_tcoords1->begin(), wc_tcoords1->begin() + vertexListSize);
-	if(flags & SR_LIGHTING)
-		wc_normals->erase(wc_normals->begin(), wc_normals->begin() + vertexListSize);
-	if(flags & SR_COLOR)
-		wc_colors->erase(wc_colors->begin(), wc_colors->begin() + vertexListSize);
-#endif
-}
-
 
+	const size_t clipped = wc_clipStreams[0].size();
+	for(int s = 0; s < numStreams; ++s)
+		streams[s] = clipped ? &wc_clipStreams[s][0] : 0;
+	return clipped;
+}
@@ -1,6 +1,16 @@
 #ifndef CLIPPLANE_H_GUARD
 #define CLIPPLANE_H_GUARD
 #include <linealg.h>
-void clip_triangle(Vector4f plane, unsigned int flags);
-int classifyTriangle(const Vector4f& v1, const Vector4f& v2, const Vector4f& v3);
+/* Clips the triangles of the vertexCount vertices in streams[0..numStreams> against
+   the near and far planes, w > 0 and a guard band around the width x height
+   screen. streams[0] are the positions, in clip space. Triangles outside a plane
+   are dropped. The vertex data itself is never written: when something needs
+   clipping, the pointers in streams are replaced by clipped copies, which live
+   until the next call. Returns the number of vertices to draw from streams. */
+size_t clip_triangles(const VectorPOD4f** streams, int numStreams, size_t vertexCount, int width, int height);
+
+/* Bits of the planes above each of the count clip space vertices is outside of.
+   A triangle whose codes have a bit in common is outside, one with no bits at
+   all is drawn as is, and the rest need clip_triangles */
+void clip_outcodes(const VectorPOD4f* vertices, size_t count, int width, int height, unsigned char* codes);
 #endif
@@ -1,51 +1,211 @@
 #include <algorithm>
 #include "framebuffer.h"
+#include "rasterizer.h"
 
 Buffer2D<unsigned int> wc_screenbuffer; //actual pointer to HW framebuffer (default)
 Buffer2D<unsigned short> wc_screendepthbuffer; //default depth buffer
+Buffer2D<unsigned int> wc_screendepthbuffer32;
+Buffer2D<float> wc_screendepthbufferf;
 Buffer2D<unsigned int>* wc_colorbuffer; //points to current buffer
 Buffer2D<unsigned short>* wc_depthbuffer; //points to current
+Buffer2D<unsigned int>* wc_depthbuffer32;
+Buffer2D<float>* wc_depthbufferf;
+int wc_depthFormat = SR_DEPTH_16;
 
+//Format of the default depth buffer
+static int wc_screenDepthFormat = SR_DEPTH_16;
 
-void SR_InitBuffers(unsigned int width, unsigned int height)
+//Fast clears of the bound buffers, one flag per block that still has to be
+//cleared. The flags are only looked at while a clear is pending.
+static std::vector<unsigned char> wc_colorClearBlocks;
+static std::vector<unsigned char> wc_depthClearBlocks;
+static bool wc_colorClearPending = false;
+static bool wc_depthClearPending = false;
+
+template<typename T>
+static void FillRect(T* p, unsigned int pitch, unsigned int x, unsigned int y,
+                     unsigned int w, unsigned int h, T value)
+{
+	for(unsigned int iy = y; iy < y + h; ++iy)
+		std::fill(p + iy*pitch + x, p + iy*pitch + x + w, value);
+}
+
+/* Fills a rectangle of the bound depth buffer with the far plane of its format */
+static void ClearDepthRect(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	if(wc_depthFormat == SR_DEPTH_16)
+		FillRect<unsigned short>(wc_depthbuffer->Ptr(), wc_depthbuffer->w, x, y, w, h, 0xFFFF);
+	else if(wc_depthFormat == SR_DEPTH_FLOAT_REVERSED)
+		FillRect<float>(wc_depthbufferf->Ptr(), wc_depthbufferf->w, x, y, w, h, 0.0f);
+	else
+		FillRect<unsigned int>(wc_depthbuffer32->Ptr(), wc_depthbuffer32->w, x, y, w, h,
+		                       wc_depthFormat == SR_DEPTH_24 ? 0xFFFFFF : 0xFFFFFFFF);
+}
+
+/* Range of the blocks of a buffer with blocksX * blocksY blocks that lie in the
+   pixel rectangle at (x, y). Partially covered blocks are left out */
+static void BlockRange(unsigned int blocksX, unsigned int blocksY, unsigned int x, unsigned int y,
+                       unsigned int w, unsigned int h,
+                       unsigned int& bx0, unsigned int& by0, unsigned int& bx1, unsigned int& by1)
+{
+	bx0 = (x + SR_CLEAR_BLOCK - 1) / SR_CLEAR_BLOCK;
+	by0 = (y + SR_CLEAR_BLOCK - 1) / SR_CLEAR_BLOCK;
+	bx1 = std::min((x + w) / SR_CLEAR_BLOCK, blocksX);
+	by1 = std::min((y + h) / SR_CLEAR_BLOCK, blocksY);
+}
+
+/* Clears the pending blocks of the color buffer p in the pixel rectangle at (x, y) */
+static void ResolveColorBlocks(unsigned int* p, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	const unsigned int blocksX = wc_colorbuffer->w / SR_CLEAR_BLOCK;
+	unsigned int bx0, by0, bx1, by1;
+	BlockRange(blocksX, wc_colorbuffer->h / SR_CLEAR_BLOCK, x, y, w, h, bx0, by0, bx1, by1);
+	for(unsigned int by = by0; by < by1; ++by) {
+		for(unsigned int bx = bx0; bx < bx1; ++bx) {
+			unsigned char& pending = wc_colorClearBlocks[by*blocksX + bx];
+			if(!pending)
+				continue;
+			FillRect<unsigned int>(p, wc_colorbuffer->w, bx*SR_CLEAR_BLOCK, by*SR_CLEAR_BLOCK,
+			                       SR_CLEAR_BLOCK, SR_CLEAR_BLOCK, 0);
+			pending = 0;
+		}
+	}
+}
+
+/* Like ResolveColorBlocks, for the bound depth buffer */
+static void ResolveDepthBlocks(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	const unsigned int blocksX = SR_DepthWidth() / SR_CLEAR_BLOCK;
+	unsigned int bx0, by0, bx1, by1;
+	BlockRange(blocksX, SR_DepthHeight() / SR_CLEAR_BLOCK, x, y, w, h, bx0, by0, bx1, by1);
+	for(unsigned int by = by0; by < by1; ++by) {
+		for(unsigned int bx = bx0; bx < bx1; ++bx) {
+			unsigned char& pending = wc_depthClearBlocks[by*blocksX + bx];
+			if(!pending)
+				continue;
+			ClearDepthRect(bx*SR_CLEAR_BLOCK, by*SR_CLEAR_BLOCK, SR_CLEAR_BLOCK, SR_CLEAR_BLOCK);
+			pending = 0;
+		}
+	}
+}
+
+
+void SR_InitBuffers(unsigned int width, unsigned int height, int depthFormat)
 {
+	//New buffers, whatever was pending is gone with the old ones
+	wc_colorClearPending = false;
+	wc_depthClearPending = false;
 	wc_screenbuffer = Buffer2D<unsigned int>(width, height, 0, true);
-	wc_screendepthbuffer = Buffer2D<unsigned short>(width, height, 0, false);
+	wc_screenDepthFormat = depthFormat;
+	if(depthFormat == SR_DEPTH_16)
+		wc_screendepthbuffer = Buffer2D<unsigned short>(width, height, 0, false);
+	else if(depthFormat == SR_DEPTH_FLOAT_REVERSED)
+		wc_screendepthbufferf = Buffer2D<float>(width, height, 0, false);
+	else
+		wc_screendepthbuffer32 = Buffer2D<unsigned int>(width, height, 0, false);
 	SR_BindDefaultBuffers();
 	return;
 }
 
+/* Only flags the blocks, and clears what is left of the buffer outside of them */
 void SR_ClearBuffer(unsigned int type)
 {
 	if((type & SR_COLOR_BUFFER) && wc_colorbuffer != 0) {
+		const unsigned int w = wc_colorbuffer->w;
+		const unsigned int h = wc_colorbuffer->h;
+		const unsigned int blocksX = w / SR_CLEAR_BLOCK;
+		const unsigned int blocksY = h / SR_CLEAR_BLOCK;
+		wc_colorClearBlocks.assign(blocksX * blocksY, 1);
+		wc_colorClearPending = true;
+		if(blocksX * SR_CLEAR_BLOCK < w || blocksY * SR_CLEAR_BLOCK < h) {
+			unsigned int* p = wc_colorbuffer->Lock();
+			FillRect<unsigned int>(p, w, blocksX * SR_CLEAR_BLOCK, 0, w - blocksX * SR_CLEAR_BLOCK, h, 0);
+			FillRect<unsigned int>(p, w, 0, blocksY * SR_CLEAR_BLOCK, blocksX * SR_CLEAR_BLOCK, h - blocksY * SR_CLEAR_BLOCK, 0);
+			wc_colorbuffer->Unlock();
+		}
+	}
+	//Cleared to the far plane
+	const bool depthBound = wc_depthFormat == SR_DEPTH_16 ? wc_depthbuffer != 0 :
+	                        wc_depthFormat == SR_DEPTH_FLOAT_REVERSED ? wc_depthbufferf != 0 : wc_depthbuffer32 != 0;
+	if((type & SR_DEPTH_BUFFER) && depthBound) {
+		const unsigned int w = SR_DepthWidth();
+		const unsigned int h = SR_DepthHeight();
+		const unsigned int blocksX = w / SR_CLEAR_BLOCK;
+		const unsigned int blocksY = h / SR_CLEAR_BLOCK;
+		wc_depthClearBlocks.assign(blocksX * blocksY, 1);
+		wc_depthClearPending = true;
+		ClearDepthRect(blocksX * SR_CLEAR_BLOCK, 0, w - blocksX * SR_CLEAR_BLOCK, h);
+		ClearDepthRect(0, blocksY * SR_CLEAR_BLOCK, blocksX * SR_CLEAR_BLOCK, h - blocksY * SR_CLEAR_BLOCK);
+		SR_ResetHiZ(65535, 65535);
+	}
+	return;
+}
+
+void SR_ResolveClearRect(unsigned int* colorbuffer, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	if(wc_colorClearPending && colorbuffer)
+		ResolveColorBlocks(colorbuffer, x, y, w, h);
+	if(wc_depthClearPending)
+		ResolveDepthBlocks(x, y, w, h);
+}
+
+void SR_ResolveClears(unsigned int type)
+{
+	if((type & SR_COLOR_BUFFER) && wc_colorClearPending) {
 		unsigned int* p = wc_colorbuffer->Lock();
-		//std::fill(wc_colorbuffer.data.begin(),
-		//		  wc_colorbuffer.data.end(), 0xFFFFFFFF);
-		unsigned int len = wc_colorbuffer->w * wc_colorbuffer->h * sizeof(unsigned int);
-		memset(p, 0, len);
+		ResolveColorBlocks(p, 0, 0, wc_colorbuffer->w, wc_colorbuffer->h);
 		wc_colorbuffer->Unlock();
+		wc_colorClearPending = false;
 	}
-	if((type & SR_DEPTH_BUFFER) && wc_depthbuffer != 0) {
-		//std::fill(wc_depthbuffer.data.begin(),
-		//		  wc_depthbuffer.data.end(), 65535);
-		unsigned short* p = wc_depthbuffer->Ptr();
-		unsigned int len = wc_depthbuffer->w * wc_depthbuffer->h * sizeof(unsigned short);
-		memset(p, 255, len);
+	if((type & SR_DEPTH_BUFFER) && wc_depthClearPending) {
+		ResolveDepthBlocks(0, 0, SR_DepthWidth(), SR_DepthHeight());
+		wc_depthClearPending = false;
 	}
-	return;
 }
 
 void SR_BindDefaultBuffers()
 {
+	SR_ResolveClears();
 	wc_colorbuffer = &wc_screenbuffer;
+	wc_depthFormat = wc_screenDepthFormat;
 	wc_depthbuffer = &wc_screendepthbuffer;
+	wc_depthbuffer32 = &wc_screendepthbuffer32;
+	wc_depthbufferf = &wc_screendepthbufferf;
+	SR_ResetHiZ(0, 65535);
 }
 
 /* This allows you to render to textures */
 void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<unsigned short>* depthbuffer)
 {
+	SR_ResolveClears();
 	wc_colorbuffer = colorbuffer;
+	wc_depthFormat = SR_DEPTH_16;
 	wc_depthbuffer = depthbuffer;
+	wc_depthbuffer32 = 0;
+	wc_depthbufferf = 0;
+	SR_ResetHiZ(0, 65535);
+}
+
+void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<unsigned int>* depthbuffer, int depthFormat)
+{
+	SR_ResolveClears();
+	wc_colorbuffer = colorbuffer;
+	wc_depthFormat = depthFormat == SR_DEPTH_24 ? SR_DEPTH_24 : SR_DEPTH_32;
+	wc_depthbuffer = 0;
+	wc_depthbuffer32 = depthbuffer;
+	wc_depthbufferf = 0;
+	SR_ResetHiZ(0, 65535);
+}
+
+void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<float>* depthbuffer)
+{
+	SR_ResolveClears();
+	wc_colorbuffer = colorbuffer;
+	wc_depthFormat = SR_DEPTH_FLOAT_REVERSED;
+	wc_depthbuffer = 0;
+	wc_depthbuffer32 = 0;
+	wc_depthbufferf = depthbuffer;
+	SR_ResetHiZ(0, 65535);
 }
 
 void SR_Flip()
@@ -54,6 +214,8 @@ void SR_Flip()
 	SDL_LockSurface(s);
 	unsigned int* p = static_cast<unsigned int*>(s->pixels);
 	*/
+	//Blocks that nothing was drawn to since the clear
+	SR_ResolveClears(SR_COLOR_BUFFER);
 	SDL_Surface* s = SDL_GetVideoSurface();
 	//std::copy(wc_colorbuffer.data.begin(), wc_colorbuffer.data.end(), p);
 	//wc_colorbuffer->Lock();
@@ -4,17 +4,60 @@
 #include <vector>
 #include "buffer.h"
 
+/* Depth buffer formats */
+const int SR_DEPTH_16 = 0; //16-bit unorm, the default. Least bandwidth
+const int SR_DEPTH_24 = 1; //24-bit unorm, in the low bits of 32-bit words
+const int SR_DEPTH_32 = 2; //32-bit unorm
+const int SR_DEPTH_FLOAT_REVERSED = 3; //float, 1 at the near plane and 0 at the far plane
+
 extern Buffer2D<unsigned int> wc_screenbuffer; //actual pointer to HW framebuffer (default)
-extern Buffer2D<unsigned short> wc_screendepthbuffer; //default depth buffer
+extern Buffer2D<unsigned short> wc_screendepthbuffer; //default depth buffer, SR_DEPTH_16
+extern Buffer2D<unsigned int> wc_screendepthbuffer32; //default depth buffer, SR_DEPTH_24 and SR_DEPTH_32
+extern Buffer2D<float> wc_screendepthbufferf; //default depth buffer, SR_DEPTH_FLOAT_REVERSED
 extern Buffer2D<unsigned int>* wc_colorbuffer;
+//The bound depth buffer is the one of these that matches wc_depthFormat
 extern Buffer2D<unsigned short>* wc_depthbuffer;
+extern Buffer2D<unsigned int>* wc_depthbuffer32;
+extern Buffer2D<float>* wc_depthbufferf;
+extern int wc_depthFormat;
 
 const unsigned int SR_COLOR_BUFFER=1;
 const unsigned int SR_DEPTH_BUFFER=2;
 
-void SR_InitBuffers(unsigned int width, unsigned int height);
+void SR_InitBuffers(unsigned int width, unsigned int height, int depthFormat = SR_DEPTH_16);
 void SR_ClearBuffer(unsigned int type);
+
+/* Fast clears. SR_ClearBuffer only marks the blocks of SR_CLEAR_BLOCK x SR_CLEAR_BLOCK
+   pixels of the bound buffers as cleared. The rasterizer clears a block right before
+   it first draws to it, and SR_Flip fills in the color of the blocks nothing was drawn
+   to. Binding other buffers resolves the pending clears of the old ones. */
+const unsigned int SR_CLEAR_BLOCK = 8;
+/* Clears the pending blocks inside the rectangle at pixel (x, y). colorbuffer is the
+   locked color buffer, or 0 to leave its blocks pending. Threads can resolve
+   rectangles that share no block at the same time */
+void SR_ResolveClearRect(unsigned int* colorbuffer, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+/* Clears every pending block, before reading a buffer directly */
+void SR_ResolveClears(unsigned int type = SR_COLOR_BUFFER | SR_DEPTH_BUFFER);
 void SR_BindDefaultBuffers();
 void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<unsigned short>* depthbuffer);
+/* depthFormat is SR_DEPTH_24 or SR_DEPTH_32 */
+void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<unsigned int>* depthbuffer, int depthFormat);
+/* Reversed-Z float depth, SR_DEPTH_FLOAT_REVERSED */
+void SR_BindBuffers(Buffer2D<unsigned int>* colorbuffer, Buffer2D<float>* depthbuffer);
 void SR_Flip();
+
+/* Size of the bound depth buffer, whatever its format */
+inline unsigned int SR_DepthWidth()
+{
+	if(wc_depthFormat == SR_DEPTH_16) return wc_depthbuffer->w;
+	if(wc_depthFormat == SR_DEPTH_FLOAT_REVERSED) return wc_depthbufferf->w;
+	return wc_depthbuffer32->w;
+}
+
+inline unsigned int SR_DepthHeight()
+{
+	if(wc_depthFormat == SR_DEPTH_16) return wc_depthbuffer->h;
+	if(wc_depthFormat == SR_DEPTH_FLOAT_REVERSED) return wc_depthbufferf->h;
+	return wc_depthbuffer32->h;
+}
 #endif
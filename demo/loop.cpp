@@ -1,9 +1,11 @@
 #include "misc.h"
 #include "framebuffer.h"
+#include "workers.h"
 #include <SDL/SDL.h>
 
 static void SR_Quit()
 {
+	SR_QuitWorkers();
 	SDL_Quit();
 	exit(0);
 }
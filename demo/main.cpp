@@ -14,25 +14,33 @@
 struct Mesh {
 	std::vector<VectorPOD4f> vertexData; // Our original mesh
 	std::vector<VectorPOD4f> tcoordData; // Our original mesh
+	std::vector<unsigned int> indices;
+};
+
+//One copy of the mesh on screen
+struct Instance {
 	float rotationSpeed;
 	VectorPOD4f position;
 };
 
 //float time_elapsed = 8.472656f;
 unsigned int printAccum = 0;
-const int NUM_MESHES = 100;
+const int NUM_INSTANCES = 100;
 
-MatrixPOD4f clipMatrix;
+//Every instance draws the same mesh, so its geometry is only stored once
+struct Scene {
+	Mesh mesh;
+	Instance instances[NUM_INSTANCES];
+};
 
-std::vector<VectorPOD4f> projVerts;
-std::vector<VectorPOD4f> projTex;
+MatrixPOD4f clipMatrix;
 
 static void loop(void* data)
 {
-	static bool doOnce = true;
 	unsigned int t = SDL_GetTicks();
 	float time_elapsed = static_cast<float>(t) * 0.001f;
-	Mesh* mesh = static_cast<Mesh*>(data);
+	Scene* scene = static_cast<Scene*>(data);
+	const Instance* instances = scene->instances;
 	const float fStep = 1.0f / (float)(1<<8);
 	if(SDL_GetKeyState(NULL)[SDLK_LEFT]) {
 		time_elapsed -= fStep;
@@ -47,39 +55,31 @@ static void loop(void* data)
 
 	float rt = time_elapsed;
 
-	projVerts.clear();
-	projTex.clear();
+	MatrixPOD4f modelviewProjection[NUM_INSTANCES];
 
-	for(int i = 0; i < NUM_MESHES; ++i) {
-		float xOffset = 1.8f * std::sin(2.0f * M_PI * rt * mesh[i].rotationSpeed);
+	for(int i = 0; i < NUM_INSTANCES; ++i) {
+		float xOffset = 1.8f * std::sin(2.0f * M_PI * rt * instances[i].rotationSpeed);
 		VectorPOD4f offsetVec = {xOffset, 0.0f, 0.0f, 1.0f};
 
-		MatrixPOD4f trans0, trans1, rotX, rotY, rotZ, worldMatrix, modelviewProjection;
+		MatrixPOD4f trans0, trans1, rotX, rotY, rotZ, worldMatrix;
 		translate(trans0, offsetVec);
-		translate(trans1, mesh[i].position);
-		rotateX(rotX, 45.0f * rt * mesh[i].rotationSpeed);
-		rotateY(rotY, 60.0f * rt * mesh[i].rotationSpeed);
-		rotateZ(rotZ, 20.0f * rt * mesh[i].rotationSpeed);
+		translate(trans1, instances[i].position);
+		rotateX(rotX, 45.0f * rt * instances[i].rotationSpeed);
+		rotateY(rotY, 60.0f * rt * instances[i].rotationSpeed);
+		rotateZ(rotZ, 20.0f * rt * instances[i].rotationSpeed);
 
 		Mat4Mat4Mul(worldMatrix, rotY, rotZ);
 		Mat4Mat4Mul(worldMatrix, rotX, worldMatrix);
 		Mat4Mat4Mul(worldMatrix, trans1, worldMatrix);
 		Mat4Mat4Mul(worldMatrix, trans0, worldMatrix);
-		Mat4Mat4Mul(modelviewProjection, clipMatrix, worldMatrix);
-
-		for(int j = 0; j < mesh[i].vertexData.size(); j+=3) {
-			projVerts.push_back(Mat4Vec4Mul(modelviewProjection, mesh[i].vertexData[j + 0]));
-			projVerts.push_back(Mat4Vec4Mul(modelviewProjection, mesh[i].vertexData[j + 1]));
-			projVerts.push_back(Mat4Vec4Mul(modelviewProjection, mesh[i].vertexData[j + 2]));
-			projTex.push_back(mesh[i].tcoordData[j + 0]);
-			projTex.push_back(mesh[i].tcoordData[j + 1]);
-			projTex.push_back(mesh[i].tcoordData[j + 2]);
-		}
+		Mat4Mat4Mul(modelviewProjection[i], clipMatrix, worldMatrix);
 	}
 
-	SR_SetVertices(&projVerts);
-	SR_SetTexCoords0(&projTex);
-	SR_Render(SR_TEXCOORD0);
+	//The cube is drawn once per matrix
+	SR_SetVertices(&scene->mesh.vertexData);
+	SR_SetTexCoords0(&scene->mesh.tcoordData);
+	SR_SetIndices(&scene->mesh.indices);
+	SR_RenderInstanced(SR_TEXCOORD0, modelviewProjection, NUM_INSTANCES);
 	SR_Flip();
 
 #ifdef DEBUG
@@ -112,17 +112,18 @@ int main(int argc, char* argv[])
 	const int width = 640;
 	const int height = 480;
 	const int depth = 32;
-	Mesh mesh[NUM_MESHES];
+	Scene scene;
 
 	//srand(time(NULL));
 	perspective(clipMatrix, 60.0f, (float)width/(float)height, 1.0f, 40.0f);
 
-	for(int i = 0; i < NUM_MESHES; ++i) {
-		mesh[i].rotationSpeed = rnd_min_max(0.0f, 0.25f);
-		mesh[i].position.x = rnd_min_max(-1.0f, 1.0f);
-		mesh[i].position.y = rnd_min_max(-1.0f, 1.0f);
-		mesh[i].position.z = rnd_min_max(-2.5f, -30.0f);
-		mesh[i].position.w = 1.0f;
+	for(int i = 0; i < NUM_INSTANCES; ++i) {
+		Instance& instance = scene.instances[i];
+		instance.rotationSpeed = rnd_min_max(0.0f, 0.25f);
+		instance.position.x = rnd_min_max(-1.0f, 1.0f);
+		instance.position.y = rnd_min_max(-1.0f, 1.0f);
+		instance.position.z = rnd_min_max(-2.5f, -30.0f);
+		instance.position.w = 1.0f;
 	}
 	SR_Init(width, height);
 	SR_SetCaption("Tile-Rasterizer Test");
@@ -130,8 +131,13 @@ int main(int argc, char* argv[])
 	const Texture* tex = ReadPNG("texture0.png");
 	SR_BindTexture0(tex);
 
-	for(int i=0; i<NUM_MESHES; ++i)
-		makeMeshCube(mesh[i].vertexData, mesh[i].tcoordData, 1.0f);
+	//20 unique vertices instead of 36 per cube
+	makeMeshCube(scene.mesh.vertexData, scene.mesh.tcoordData, 1.0f);
+	makeMeshIndexed(scene.mesh.vertexData, scene.mesh.tcoordData, scene.mesh.indices);
+
+	//Pick the fastest tile size for this machine and resolution
+	int tileSize = SR_AutotuneTileSize(loop, (void*)&scene, 32);
+	printf("tile size: %dx%d\n", tileSize, tileSize);
 
-	SR_MainLoop(loop, quit, (void*)&mesh[0]);
+	SR_MainLoop(loop, quit, (void*)&scene);
 }
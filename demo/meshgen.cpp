@@ -1,5 +1,8 @@
 #include <vector>
+#include <map>
+#include <cstring>
 #include <linealg.h>
+#include "vertexdata.h"
 #include "meshgen.h"
 
 void makeMeshSphere(std::vector<VectorPOD4f>& vertexData,
@@ -85,6 +88,49 @@ void makeMeshSphere(std::vector<VectorPOD4f>& vertexData,
 	}
 }
 
+void makeMeshSphereStrip(std::vector<VectorPOD4f>& vertexData,
+                         std::vector<VectorPOD4f>& tcoordData,
+                         std::vector<unsigned int>& indices,
+                         float radius)
+{
+	const int resolution = 100;
+	const float halfPI = PI * 0.5f;
+	float interp = 1.0f / (float)resolution;
+	VectorPOD4f v, tc;
+	radius *= 0.5f;
+
+	//Same rings as makeMeshSphere, resolution + 2 vertices around each
+	const int rowSize = resolution + 2;
+	vertexData.reserve(rowSize*rowSize);
+	tcoordData.reserve(rowSize*rowSize);
+	indices.reserve((resolution+1)*(rowSize*2 + 1));
+	v.w = 1.0f;
+	tc.z = tc.w = 0.0f;
+	for(int i=0; i<=resolution+1; ++i) {
+		float theta = interp*(float)i*PI - halfPI;
+		for(int j=0; j<=resolution+1; ++j) {
+			float phi = interp*(float)j*2.0f*PI;
+			float x = std::cos(theta)*std::cos(phi);
+			float y = std::cos(theta)*std::sin(phi);
+			v.x = x * radius;
+			v.y = y * radius;
+			v.z = std::sin(theta) * radius;
+			tc.x = x * 0.5f + 0.5f;
+			tc.y = y * 0.5f + 0.5f;
+			vertexData.push_back(v);
+			tcoordData.push_back(tc);
+		}
+	}
+	//Zigzag between ring i + 1 and ring i
+	for(int i=0; i<=resolution; ++i) {
+		for(int j=0; j<rowSize; ++j) {
+			indices.push_back((i+1)*rowSize + j);
+			indices.push_back(i*rowSize + j);
+		}
+		indices.push_back(SR_PRIMITIVE_RESTART);
+	}
+}
+
 void makeMeshCircle(std::vector<VectorPOD4f>& dst, float radius)
 {
 	const int resolution = 64;
@@ -170,6 +216,20 @@ void makeMeshPlane(std::vector<VectorPOD4f>& vertexData,
 	tcoordData.push_back(t3);
 }
 
+void makeMeshPlaneStrip(std::vector<VectorPOD4f>& vertexData,
+                        std::vector<VectorPOD4f>& tcoordData,
+                        float size)
+{
+	//The triangles of makeMeshPlane are v0 v1 v2 and v2 v1 v3, the strip v0 v1 v2 v3
+	std::vector<VectorPOD4f> v, tc;
+	makeMeshPlane(v, tc, size);
+	const int strip[] = {0, 1, 2, 5};
+	for(int i=0; i<4; ++i) {
+		vertexData.push_back(v[strip[i]]);
+		tcoordData.push_back(tc[strip[i]]);
+	}
+}
+
 void makeMeshCube(std::vector<VectorPOD4f>& vertexData,
                   std::vector<VectorPOD4f>& tcoordData,
                   float size)
@@ -289,3 +349,35 @@ void makeMeshCube(std::vector<VectorPOD4f>& vertexData,
 		tcoordData.push_back(t3);
 	}
 }
+
+/* Position and texture coordinate, ordered by their bytes */
+struct MeshVertex {
+	VectorPOD4f v, tc;
+	bool operator<(const MeshVertex& o) const {
+		return memcmp(this, &o, sizeof(MeshVertex)) < 0;
+	}
+};
+
+void makeMeshIndexed(std::vector<VectorPOD4f>& vertexData,
+                     std::vector<VectorPOD4f>& tcoordData,
+                     std::vector<unsigned int>& indices)
+{
+	std::map<MeshVertex, unsigned int> unique;
+	std::vector<VectorPOD4f> vertices, tcoords;
+	indices.clear();
+	indices.reserve(vertexData.size());
+	for(size_t i = 0; i < vertexData.size(); ++i) {
+		MeshVertex mv;
+		mv.v = vertexData[i];
+		mv.tc = tcoordData[i];
+		std::map<MeshVertex, unsigned int>::iterator it = unique.find(mv);
+		if(it == unique.end()) {
+			it = unique.insert(std::make_pair(mv, (unsigned int)vertices.size())).first;
+			vertices.push_back(mv.v);
+			tcoords.push_back(mv.tc);
+		}
+		indices.push_back(it->second);
+	}
+	vertexData.swap(vertices);
+	tcoordData.swap(tcoords);
+}
@@ -9,7 +9,22 @@ void makeMeshCircle(std::vector<VectorPOD4f>& dst, float radius);
 void makeMeshPlane(std::vector<VectorPOD4f>& vertexData,
                    std::vector<VectorPOD4f>& tcoordData,
                    float size);
+/* The same meshes as unique vertices and an index list for SR_TRIANGLE_STRIP,
+   with a strip per ring of the sphere */
+void makeMeshSphereStrip(std::vector<VectorPOD4f>& vertexData,
+                         std::vector<VectorPOD4f>& tcoordData,
+                         std::vector<unsigned int>& indices,
+                         float radius);
+/* Four vertices, a strip of two triangles without indices */
+void makeMeshPlaneStrip(std::vector<VectorPOD4f>& vertexData,
+                        std::vector<VectorPOD4f>& tcoordData,
+                        float size);
 void makeMeshCube(std::vector<VectorPOD4f>& vertexData,
                   std::vector<VectorPOD4f>& tcoordData,
                   float size);
+/* Turns a triangle list into an indexed one for SR_SetIndices. Vertices that are
+   equal in both streams are kept once, and indices gets three per triangle */
+void makeMeshIndexed(std::vector<VectorPOD4f>& vertexData,
+                     std::vector<VectorPOD4f>& tcoordData,
+                     std::vector<unsigned int>& indices);
 #endif
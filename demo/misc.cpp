@@ -2,6 +2,7 @@
 #include "misc.h"
 #include "texture.h"
 #include "framebuffer.h"
+#include "workers.h"
 
 void SR_Init(int width, int height)
 {
@@ -11,6 +12,7 @@ void SR_Init(int width, int height)
 	SR_BindTexture0(NULL);
 	SR_BindTexture1(NULL);
 	SR_InitBuffers(width, height);
+	SR_InitWorkers(0);
 }
 
 void SR_SetCaption(const std::string& title)
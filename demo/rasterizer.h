@@ -1,17 +1,70 @@
-#ifndef RASTERIZER_H_GUARD
-#define RASTERIZER_H_GUARD
-#include <linealg.h>
-
-void DrawTriangles(unsigned int flags);
-
-/* Computes coefficients for the vertex-scalars to interpolate.
-   z, w, texture coordinates, normals, etc are multiplied with this matrix and later used
-   in DrawTriangle */
-Matrix3f ComputeCoeffMatrix(const VectorPOD4f& v1, const VectorPOD4f& v2, const VectorPOD4f& v3);
-
-//extern int zmin;
-//extern int zmax;
-
-void SR_Render(unsigned int flags);
-#endif
-
+#ifndef RASTERIZER_H_GUARD
+#define RASTERIZER_H_GUARD
+#include <linealg.h>
+
+void DrawTriangles(unsigned int flags);
+
+/* Computes coefficients for the vertex-scalars to interpolate.
+   z, w, texture coordinates, normals, etc are multiplied with this matrix and later used
+   in DrawTriangle */
+Matrix3f ComputeCoeffMatrix(const VectorPOD4f& v1, const VectorPOD4f& v2, const VectorPOD4f& v3);
+
+//extern int zmin;
+//extern int zmax;
+
+void SR_Render(unsigned int flags);
+
+/* SR_Render for numInstances copies of the bound mesh, instance i with its
+   positions transformed by matrices[i] like SR_TransformBatch. The other
+   streams, the indices and the primitive are shared by all of them. Each
+   instance is transformed into a buffer of the renderer as it is drawn. The
+   triangles emitted are binned and drawn every few ten thousand, so the
+   memory used is bounded by that or by one instance, whichever is larger,
+   and not by the number of instances. Each batch is drawn like a separate
+   SR_Render call */
+void SR_RenderInstanced(unsigned int flags, const MatrixPOD4f* matrices, int numInstances);
+
+/* Resets the coarse (per screen tile) depth bounds used for early z-culling.
+   Called when the depth buffer is cleared, or bound with unknown contents.
+   The bounds are in 16-bit depth units, 0 near and 65535 far, for every depth format */
+void SR_ResetHiZ(int zMin, int zMax);
+
+/* Tile sizes (in pixels) the deferred rasterizer is compiled for */
+const int SR_TILE_8X8 = 8;
+const int SR_TILE_16X16 = 16;
+const int SR_TILE_32X32 = 32;
+
+/* Selects the tile size used by SR_Render. The default is SR_TILE_16X16 */
+void SR_SetTileSize(int tileSize);
+int SR_GetTileSize();
+
+/* Times 'frames' calls of cb_frame with every tile size, and keeps the fastest.
+   cb_frame should render a typical frame. Returns the chosen tile size */
+int SR_AutotuneTileSize(void (*cb_frame)(void*), void* data, int frames);
+
+/* Tile-based deferred texturing. Every screen tile first resolves visibility
+   for all its triangles, then textures each visible pixel once. Pays off when
+   overdraw is high. Off by default */
+void SR_SetDeferredTexturing(bool enable);
+
+/* 4x multisample antialiasing. Coverage is tested at 4 samples per pixel, but
+   every pixel is shaded once, and its depth is used for all of its samples.
+   The color samples only exist while a screen tile is drawn: it is resolved
+   when written out, so there is no 4x color buffer, and a later draw starts
+   every color sample from the resolved pixel. The depth samples are kept
+   between draws, so depth tests along earlier edges, and SR_DEPTH_EQUAL after
+   a multisampled SR_DEPTH_ONLY pass, see the depth of each sample. The depth
+   buffer holds the nearest sample of each pixel. Where it gets cleared or
+   drawn to without multisampling, the samples of the pixel start over from it.
+   Occlusion queries count samples. Deferred texturing is not used with it.
+   Off by default */
+void SR_SetMultisampling(bool enable);
+
+/* Occlusion query. Counts the pixels that pass the depth test in the SR_Render
+   calls between SR_BeginQuery and SR_EndQuery, which returns the count.
+   Draw bounding volumes with SR_DEPTH_ONLY | SR_NO_DEPTH_WRITE, and skip
+   the objects whose volumes got 0. */
+void SR_BeginQuery();
+unsigned int SR_EndQuery();
+#endif
+
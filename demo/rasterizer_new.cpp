@@ -3,561 +3,2420 @@
 #include <vector>
 #include <cstdio>
 #include <SDL/SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include <linealg.h>
 #include <fixedpoint.h>
+#include <fastmath.h>
 #include "rasterizer.h"
 #include "clipplane.h"
 #include "vertexdata.h"
 #include "framebuffer.h"
 #include "texture.h"
+#include "workers.h"
 #include "myassert.h"
 
 //#define PASSMODE //Fill-color blit-loop for testing
 
-//Tile size base. Must be POT
-const int Q = 4;
-//Actual Tile size
-const int q = (1<<Q);
-
-//Fixedpoint base for coefficients
-const int coeff_precision_base = 11;
-//Fixedpoint base for NDC coordinates (we convert screen-space coords to NDCs later)
-const int ndc_precision_base = 20;
-//Need 16-bits precision for z-buffer
-const int depth_precision_base = 16;
-//The actual scalars for the bases above (precision = 1 << base)
-const float f_coeff_precision = (float)(1 << coeff_precision_base);
-const float f_ndc_precision = (float)(1 << ndc_precision_base);
-const float f_depth_precision = (float)(1 << depth_precision_base);
-const int i_coeff_precision = 1 << coeff_precision_base;
-const int i_ndc_precision = 1 << ndc_precision_base;
-const int i_depth_precision = 1 << depth_precision_base;
-//Base to use when converting from NDC coordinates to coefficients
-const int base_diff = (ndc_precision_base - coeff_precision_base);
-//Base to use when converting from NDC coordinates to depth
-const int base_diff_z = (ndc_precision_base - depth_precision_base);
+/* Compile-time tile size and fixed-point precisions of the rasterizer.
+   The accumulators in the blitters are shifted up by Q*2 bits, so bigger
+   tiles need a lower coefficient precision to keep w from overflowing. */
+template<int TileBase, int CoeffBase>
+struct TilePolicy {
+	enum {
+		//Tile size base. Must be POT
+		Q = TileBase,
+		//Actual Tile size
+		q = (1<<Q),
+		//Macro tile size base for hierarchical binning (4x4 tiles)
+		MQ = Q + 2,
+		//Actual macro tile size
+		mq = (1<<MQ),
+		//Fixedpoint base for coefficients
+		coeff_precision_base = CoeffBase,
+		//Fixedpoint base for NDC coordinates (we convert screen-space coords to NDCs later)
+		ndc_precision_base = 20,
+		//Need 16-bits precision for z-buffer
+		depth_precision_base = 16,
+		//The actual scalars for the bases above (precision = 1 << base)
+		i_coeff_precision = 1 << coeff_precision_base,
+		i_ndc_precision = 1 << ndc_precision_base,
+		i_depth_precision = 1 << depth_precision_base,
+		//Largest value the depth buffer holds (and the value it is cleared to)
+		depth_max = (1 << depth_precision_base) - 1,
+		//Base to use when converting from NDC coordinates to coefficients
+		base_diff = (ndc_precision_base - coeff_precision_base),
+		//Base to use when converting from NDC coordinates to depth
+		base_diff_z = (ndc_precision_base - depth_precision_base)
+	};
+};
+
+typedef TilePolicy<3, 11> Policy8x8;
+typedef TilePolicy<4, 11> Policy16x16;
+typedef TilePolicy<5, 10> Policy32x32;
+
+/* Layout of the varyings interpolated for a set of SR_Render flags F.
+   Like z, every varying is interpolated as value/w and multiplied by w per pixel,
+   and only the ones F uses are set up and interpolated at all. */
+template<unsigned int F>
+struct Varyings {
+	enum {
+		tex0 = 0, //u, v of texture 0
+		tex1 = tex0 + ((F & SR_TEXCOORD0) ? 2 : 0), //u, v of texture 1
+		normal = tex1 + ((F & SR_TEXCOORD1) ? 2 : 0), //x, y, z
+		color = normal + ((F & SR_LIGHTING) ? 3 : 0), //r, g, b
+		count = color + ((F & SR_COLOR) ? 3 : 0)
+	};
+};
+
+//All of the above
+const int maxVaryings = 10;
+
+/* Triangle setup, computed once by the binner and shared by every tile the
+   triangle touches. The blitters derive the tile corners from this. */
+struct TriangleSetup {
+	int DX12, DX23, DX31; //28.4 edge deltas
+	int DY12, DY23, DY31;
+	//Half-edge constants, corrected for fill convention. 64-bit, since they are
+	//the edge functions at the origin, which can be far from guard band vertices
+	long long C1, C2, C3;
+	//Coefficients for the equation s/w = Ax + By + C, x and y in NDC space.
+	//The ones of the varyings are in wc_varyingCoeffs.
+	int Az, Bz, Cz;
+	int Aw, Bw, Cw;
+	//Depth plane of the wide depth formats, in [0, 1] and unquantized.
+	//Az, Bz and Cz always hold the 16-bit one for the coarse depth buffer.
+	float zA, zB, zC;
+};
 
+/* What gets binned: the triangle, and its depth range over the tile
+   for early z-culling. The tile itself is given by the bin. */
+struct TileRef {
+	int tri; //index into wc_triangles
+	int zMin, zMax;
+};
 
+/* Corner values of a triangle over one tile, set up right before blitting */
 struct Tile {
 	int FDX12, FDX23, FDX31;
 	int FDY12, FDY23, FDY31;
 	int CY1, CY2, CY3;
 	int bw0, bw1, bw2, bw3; //w corner values
-	int bz0, bz1, bz2, bz3; //w corner values
-	int bu0, bu1, bu2, bu3; //w corner values
-	int bv0, bv1, bv2, bv3; //w corner values
-	int zMin, zMax; //for early z-culling
-	bool operator<(const Tile& t) const {
-		return zMin < t.zMin;
+	int bz0, bz1, bz2, bz3; //z corner values
+	int ba[maxVaryings][4]; //varying corner values, laid out by Varyings<F>
+	double dz0, dzdx, dzdy; //depth at the first pixel and its steps, wide depth formats only
+};
+
+/* Depth buffer formats of the blitters, one for each SR_DEPTH_*.
+   Depth16 interpolates the 16-bit corner values like the varyings. The wide
+   formats evaluate the depth plane of the triangle in double precision instead,
+   which doesn't round the same way as the 16-bit plane the binner culls with.
+   hizPad widens the depth bounds of their binned tiles to keep culling conservative. */
+struct Depth16 {
+	typedef unsigned short Type;
+	enum { planar = 0, reversed = 0, hizPad = 0 };
+	static bool Passes(Type z, Type zbuf) { return z < zbuf; }
+};
+
+//SR_DEPTH_24 and SR_DEPTH_32, which only differ in scale
+struct DepthFixed {
+	typedef unsigned int Type;
+	enum { planar = 1, reversed = 0, hizPad = 8 };
+	static bool Passes(Type z, Type zbuf) { return z < zbuf; }
+};
+
+//SR_DEPTH_FLOAT_REVERSED. Cleared to 0, so nearer is greater
+struct DepthFloat {
+	typedef float Type;
+	enum { planar = 1, reversed = 1, hizPad = 8 };
+	static bool Passes(Type z, Type zbuf) { return z > zbuf; }
+};
+
+//Binned tiles per chunk of the tile arena
+const int tileChunkSize = 32;
+
+typedef ChunkArena<TileRef, tileChunkSize> TileArena;
+typedef ChunkList<TileRef, tileChunkSize> TileSet;
+
+//Backing store for all tile bins, rewound every DrawTrianglesDeferred
+static TileArena wc_tileArena;
+//Setup of the triangles in the bins
+static std::vector<TriangleSetup> wc_triangles;
+//A, B and C of every varying of the triangles in wc_triangles,
+//3 * Varyings<F>::count per triangle: all A first, then all B, then all C
+static std::vector<int> wc_varyingCoeffs;
+
+//Projected positions and varying coefficients of the triangles SR_Render draws,
+//3 vertices per triangle. Written here so the bound streams are left as they are
+static VertexStream wc_postVertices;
+static VertexStream wc_postTcoords0;
+static VertexStream wc_postTcoords1;
+static VertexStream wc_postNormals;
+static VertexStream wc_postColors;
+
+/* Pixel bounds of the blocks a triangle touches, aligned to the tile size and
+   clipped to the screen. first is the first vertex of the triangle. */
+struct TriangleBounds {
+	int first;
+	int minx, miny, maxx, maxy;
+	bool smallerThanTile; //can't cover a whole tile
+};
+
+//Triangles that came through setup and go to the binner, see SetupTriangles
+static std::vector<TriangleSetup> wc_setupTriangles;
+static std::vector<TriangleBounds> wc_setupBounds;
+
+/* Per screen tile state, one set for every tile size */
+template<class P>
+struct TileBins {
+	static std::vector<TileSet> tileListFilled; //completely filled tiles
+	static std::vector<TileSet> tileList; //Partially filled
+
+	/* Coarse depth buffer, one entry per screen tile.
+	   hizMax is a conservative max of the depth buffer in the tile (everything
+	   behind it is occluded), hizMin a conservative min (everything in front of
+	   it passes the z-test). The binner lowers hizMax with the filled tiles it
+	   bins, the blitters keep both up to date as tiles are written. */
+	static std::vector<int> hizMin;
+	static std::vector<int> hizMax;
+};
+
+template<class P> std::vector<TileSet> TileBins<P>::tileListFilled;
+template<class P> std::vector<TileSet> TileBins<P>::tileList;
+template<class P> std::vector<int> TileBins<P>::hizMin;
+template<class P> std::vector<int> TileBins<P>::hizMax;
+
+//Tile size in use, one of SR_TILE_*
+static int wc_tileSize = SR_TILE_16X16;
+
+template<class P>
+static void ResetHiZ(int zMin, int zMax)
+{
+	const unsigned int numTiles = (SR_DepthWidth() >> P::Q) * (SR_DepthHeight() >> P::Q);
+	TileBins<P>::hizMin.assign(numTiles, zMin);
+	TileBins<P>::hizMax.assign(numTiles, zMax);
+}
+
+void SR_ResetHiZ(int zMin, int zMax)
+{
+	ResetHiZ<Policy8x8>(zMin, zMax);
+	ResetHiZ<Policy16x16>(zMin, zMax);
+	ResetHiZ<Policy32x32>(zMin, zMax);
+}
+
+/* Pixel depths are clamped to 16 bits, so the tile bounds
+   only say something about the pixels when they are in range */
+template<class P>
+static inline bool TileDepthInRange(const TileRef& t)
+{
+	return t.zMin >= 0 && t.zMax <= P::depth_max;
+}
+
+/* Depth at the corners of the tile starting at pixel (x, y) */
+template<class P>
+static inline void TileDepthCorners(const TriangleSetup& tri, int x, int y,
+                                    int NDC_x_step, int NDC_y_step,
+                                    int& bz0, int& bz1, int& bz2, int& bz3)
+{
+	const int NDC_x0 = x * NDC_x_step;  //min x
+	const int NDC_y0 = y * NDC_y_step;  //min y
+	const int NDC_x1 = (x + P::q - 1) * NDC_x_step; //max x
+	const int NDC_y1 = (y + P::q - 1) * NDC_y_step; //max y
+
+	const int bzx0 = (NDC_x0 - P::i_ndc_precision) >> P::base_diff_z;
+	const int bzx1 = (NDC_x1 - P::i_ndc_precision) >> P::base_diff_z;
+	const int bzy0 = (NDC_y0 - P::i_ndc_precision) >> P::base_diff_z;
+	const int bzy1 = (NDC_y1 - P::i_ndc_precision) >> P::base_diff_z;
+
+	bz0 = (((long long)tri.Az*bzx0 + (long long)tri.Bz*bzy0) >> P::depth_precision_base) + tri.Cz; //top left
+	bz1 = (((long long)tri.Az*bzx0 + (long long)tri.Bz*bzy1) >> P::depth_precision_base) + tri.Cz; //bottom left
+	bz2 = (((long long)tri.Az*bzx1 + (long long)tri.Bz*bzy0) >> P::depth_precision_base) + tri.Cz; //top right
+	bz3 = (((long long)tri.Az*bzx1 + (long long)tri.Bz*bzy1) >> P::depth_precision_base) + tri.Cz; //bottom right
+}
+
+/* Edge function at a tile corner, for the blitters to step in 32 bits. Far from
+   the edge only the sign matters, so it is clamped to +-2^30. The clipper keeps
+   vertices close enough for an edge to change by at most 2^29 over a tile, so
+   a clamped edge keeps its sign over the whole tile. */
+static inline int ClampEdge(long long e)
+{
+	const long long limit = 1 << 30;
+	return (int)std::max(-limit, std::min(e, limit));
+}
+
+/* Computes the edge functions and the corner values of w, z and the varyings
+   for the tile starting at pixel (x, y). coeffs are the varying coefficients
+   of the triangle in wc_varyingCoeffs. */
+template<class P, unsigned int F>
+static void SetupTile(const TriangleSetup& tri, const int* coeffs, int x, int y,
+                      int NDC_x_step, int NDC_y_step, Tile& tile)
+{
+	const int V = Varyings<F>::count;
+	const int x0 = x << 4;
+	const int y0 = y << 4;
+
+	const int NDC_x0 = x * NDC_x_step;  //min x
+	const int NDC_y0 = y * NDC_y_step;  //min y
+	const int NDC_x1 = (x + P::q - 1) * NDC_x_step; //max x
+	const int NDC_y1 = (y + P::q - 1) * NDC_y_step; //max y
+
+	const int bwx0 = (NDC_x0 - P::i_ndc_precision) >> P::base_diff;
+	const int bwx1 = (NDC_x1 - P::i_ndc_precision) >> P::base_diff;
+	const int bwy0 = (NDC_y0 - P::i_ndc_precision) >> P::base_diff;
+	const int bwy1 = (NDC_y1 - P::i_ndc_precision) >> P::base_diff;
+
+	int bwi[4];
+	bwi[0] = ((tri.Aw*bwx0 + tri.Bw*bwy0) >> P::coeff_precision_base) + tri.Cw; //top left
+	bwi[1] = ((tri.Aw*bwx0 + tri.Bw*bwy1) >> P::coeff_precision_base) + tri.Cw; //bottom left
+	bwi[2] = ((tri.Aw*bwx1 + tri.Bw*bwy0) >> P::coeff_precision_base) + tri.Cw; //top right
+	bwi[3] = ((tri.Aw*bwx1 + tri.Bw*bwy1) >> P::coeff_precision_base) + tri.Cw; //bottom right
+
+	TileDepthCorners<P>(tri, x, y, NDC_x_step, NDC_y_step, tile.bz0, tile.bz1, tile.bz2, tile.bz3);
+
+	//Compute the varyings for the corners of the tile
+	for(int k = 0; k < V; ++k) {
+		const int A = coeffs[k];
+		const int B = coeffs[V + k];
+		const int C = coeffs[2*V + k];
+		tile.ba[k][0] = ((A*bwx0 + B*bwy0) >> P::coeff_precision_base) + C; //top left
+		tile.ba[k][1] = ((A*bwx0 + B*bwy1) >> P::coeff_precision_base) + C; //bottom left
+		tile.ba[k][2] = ((A*bwx1 + B*bwy0) >> P::coeff_precision_base) + C; //top right
+		tile.ba[k][3] = ((A*bwx1 + B*bwy1) >> P::coeff_precision_base) + C; //bottom right
 	}
+
+	//w = 1 / (1/w), all four corners at once. 0 where 1/w is 0
+	int bw[4];
+	FixedReciBatch<P::coeff_precision_base * 2>(bwi, bw, 4);
+	tile.bw0 = bw[0];
+	tile.bw1 = bw[1];
+	tile.bw2 = bw[2];
+	tile.bw3 = bw[3];
+
+	tile.FDX12 = tri.DX12 << 4;
+	tile.FDX23 = tri.DX23 << 4;
+	tile.FDX31 = tri.DX31 << 4;
+	tile.FDY12 = tri.DY12 << 4;
+	tile.FDY23 = tri.DY23 << 4;
+	tile.FDY31 = tri.DY31 << 4;
+	tile.CY1 = ClampEdge(tri.C1 + (long long)tri.DX12 * y0 - (long long)tri.DY12 * x0);
+	tile.CY2 = ClampEdge(tri.C2 + (long long)tri.DX23 * y0 - (long long)tri.DY23 * x0);
+	tile.CY3 = ClampEdge(tri.C3 + (long long)tri.DX31 * y0 - (long long)tri.DY31 * x0);
+}
+
+/* A bound texture, as the blitters see it */
+struct BlitTexture {
+	const unsigned int* tbuf;
+	int iTw;
+	int iTh;
+	double uScale; //(iTw - 1) / (1 << (coeff_precision_base * 2))
+	double vScale; //(iTh - 1) / (1 << (coeff_precision_base * 2))
+};
+
+/* Everything the blitters need to know about the bound buffers, textures and light.
+   Set up once per frame and shared (read-only) by all workers. */
+struct BlitContext {
+	unsigned int* colorbuffer;
+	void* depthbuffer; //of the bound depth format
+	unsigned int width;
+	unsigned int numTilesX;
+	BlitTexture tex0;
+	BlitTexture tex1;
+	double colorScale; //255 / (1 << (coeff_precision_base * 2))
+	float lightX, lightY, lightZ; //normalized, towards the light
+	float ambient;
+	float diffuse; //1 - ambient
+	const TriangleSetup* triangles;
+	const int* varyingCoeffs;
+	int NDC_x_step;
+	int NDC_y_step;
+	double depthScale; //depth in [0, 1] to the wide depth formats
+	double depthMax; //largest value they hold
+	bool depthEqual; //SR_DEPTH_EQUAL
+	bool depthWrite; //neither SR_DEPTH_EQUAL nor SR_NO_DEPTH_WRITE
+	bool countSamples; //an occlusion query is active
+	bool deferredTexturing;
+	bool multisampling; //4x, see SR_SetMultisampling
+	void* depthSamples; //and its depth samples, see wc_sampleDepths
+	unsigned int samplePlane; //size of a plane of them, one per sample
+};
+
+/* Sample positions of 4x multisampling, in 28.4 units from the point each pixel
+   is sampled at without it. A rotated grid, so that both near horizontal and
+   near vertical edges go through 4 coverage steps. */
+const int msaaSamples = 4;
+static const int msaaSampleX[msaaSamples] = {-2, 6, -6, 2};
+static const int msaaSampleY[msaaSamples] = {-6, -2, 2, 6};
+//Largest offset. The binner grows the tiles it tests by this much
+const int msaaSamplePad = 6;
+
+/* Multisample depth, one vector for each depth format so that every one
+   is accessed as the type it holds */
+struct SampleDepthBuffers {
+	std::vector<unsigned short> depth16;
+	std::vector<unsigned int> depthFixed;
+	std::vector<float> depthFloat;
+	template<class D> std::vector<typename D::Type>& Get();
+};
+template<>
+inline std::vector<unsigned short>& SampleDepthBuffers::Get<Depth16>() { return depth16; }
+template<>
+inline std::vector<unsigned int>& SampleDepthBuffers::Get<DepthFixed>() { return depthFixed; }
+template<>
+inline std::vector<float>& SampleDepthBuffers::Get<DepthFloat>() { return depthFloat; }
+
+/* Scratch buffers of one worker, reused every frame */
+struct WorkerScratch {
+	std::vector<TileRef> sort; //bin sorting
+	std::vector<int> ids; //deferred texturing, index into tiles for every pixel of the tile
+	std::vector<Tile> tiles; //deferred texturing, the visible tiles of the bin
+	std::vector<unsigned int> sampleColors; //multisampling, color samples of the tile, one plane per sample
+	SampleDepthBuffers sampleDepths; //and its depth samples, in the format of the depth buffer
+	unsigned int samplesPassed; //occlusion query, pixels that passed the depth test
+	char pad[64]; //keep workers off each other's cache lines
 };
 
-struct TileSet {
-	TileSet() : count(0) {
-		tiles.resize(500);
+static std::vector<WorkerScratch> wc_workerScratch;
+//Resolve visibility before texturing, see SR_SetDeferredTexturing
+static bool wc_deferredTexturing = false;
+//4x multisample antialiasing, see SR_SetMultisampling
+static bool wc_multisampling = false;
+//The depth samples of the whole screen, a plane per sample, kept between draws.
+//The depth buffer holds the nearest sample of each pixel
+static SampleDepthBuffers wc_sampleDepths;
+//Directional light for SR_LIGHTING, see SR_SetLight
+static float wc_lightX = 0.0f;
+static float wc_lightY = 0.0f;
+static float wc_lightZ = 1.0f;
+static float wc_ambient = 0.2f;
+//SR_DEPTH_EQUAL and SR_NO_DEPTH_WRITE of the current SR_Render
+static bool wc_depthEqual = false;
+static bool wc_depthWrite = true;
+//Occlusion query, see SR_BeginQuery
+static bool wc_queryActive = false;
+static unsigned int wc_querySamples = 0;
+
+/* Checks a filled tile against the coarse depth bounds (zMin0, zMax0) of its
+   screen tile, and updates them for the tile being drawn. skipZTest is set when
+   the tile is in front of everything, so every pixel passes.
+   Without depth writes the bounds stay as they are. With the equal depth test
+   a tile in front of everything has no pixel that can pass. */
+template<class P>
+static inline bool FilledTileVisible(const BlitContext& ctx, const TileRef& ref, int& zMin0, int& zMax0, bool& skipZTest)
+{
+	if(TileDepthInRange<P>(ref)) {
+		if(ref.zMin > zMax0) {
+			// Occluded anyway, so skip
+			return false;
+		} else if(ctx.depthEqual) {
+			return ref.zMax >= zMin0;
+		} else if(ref.zMax < zMin0) {
+			// Totally at the front, so no need to z test.
+			// Every pixel gets overwritten
+			skipZTest = true;
+			if(ctx.depthWrite) {
+				zMin0 = ref.zMin;
+				zMax0 = std::min(zMax0, ref.zMax);
+			}
+		} else if(ctx.depthWrite) {
+			// Intersecting. Every pixel ends up at or in front of zMax
+			zMin0 = std::min(zMin0, ref.zMin);
+			zMax0 = std::min(zMax0, ref.zMax);
+		}
+	} else if(ctx.depthWrite) {
+		zMin0 = 0;
+	}
+	return true;
+}
+
+/* Like FilledTileVisible, for partially covered tiles */
+template<class P>
+static inline bool PartialTileVisible(const BlitContext& ctx, const TileRef& ref, int& zMin0, int& zMax0)
+{
+	if(TileDepthInRange<P>(ref)) {
+		if(ref.zMin > zMax0)
+			return false;
+		if(ctx.depthEqual)
+			return ref.zMax >= zMin0;
+		// Only some pixels are written, so the max stays
+		if(ctx.depthWrite)
+			zMin0 = std::min(zMin0, ref.zMin);
+	} else if(ctx.depthWrite) {
+		zMin0 = 0;
+	}
+	return true;
+}
+
+/* (a * b) / 255 per channel, rounded so that 0xFF leaves the other side unchanged */
+static inline unsigned int Modulate(unsigned int a, unsigned int b)
+{
+	unsigned int r = 0;
+	for(int s = 0; s < 32; s += 8) {
+		const unsigned int c = (((a >> s) & 0xFF) * ((b >> s) & 0xFF) + 255) >> 8;
+		r |= c << s;
+	}
+	return r;
+}
+
+/* Texture lookup from the interpolated w, u/w and v/w */
+template<class P>
+static inline unsigned int SampleTexture(const BlitTexture& tex, int uw, int vw, int w)
+{
+	int u = ((long long)uw*w*(tex.iTw - 1)) >> (P::coeff_precision_base * 2);
+	int v = ((long long)vw*w*(tex.iTh - 1)) >> (P::coeff_precision_base * 2);
+	u = clamp((int)u, 0, tex.iTw-1);
+	v = clamp((int)v, 0, tex.iTh-1);
+	return tex.tbuf[u + v*tex.iTw];
+}
+
+/* Vertex color from the interpolated w and r/w, g/w, b/w. Opaque */
+template<class P>
+static inline unsigned int VertexColor(const int* cw, int w)
+{
+	unsigned int color = 0xFF000000;
+	for(int k = 0; k < 3; ++k) {
+		int c = ((long long)cw[k]*w*255) >> (P::coeff_precision_base * 2);
+		c = clamp(c, 0, 255);
+		color |= c << (16 - k*8);
+	}
+	return color;
+}
+
+/* Gray level of the directional light for the interpolated normal/w.
+   w is positive, so it doesn't change the direction of the normal */
+static inline unsigned int Lighting(const BlitContext& ctx, const int* nw)
+{
+	const float nx = (float)nw[0];
+	const float ny = (float)nw[1];
+	const float nz = (float)nw[2];
+	const float d = nx*ctx.lightX + ny*ctx.lightY + nz*ctx.lightZ;
+	const float len = std::sqrt(nx*nx + ny*ny + nz*nz);
+	float lit = ctx.ambient;
+	if(d > 0.0f && len > 0.0f)
+		lit += ctx.diffuse * (d / len);
+	const unsigned int i = (int)(lit * 255.0f);
+	return 0xFF000000 | (i << 16) | (i << 8) | i;
+}
+
+/* Color of a pixel from its interpolated w and varyings/w, aw laid out by Varyings<F>.
+   Textures, vertex color and light are multiplied together, white when F uses none */
+template<class P, unsigned int F>
+static inline unsigned int ShadePixel(const BlitContext& ctx, int w, const int* aw)
+{
+	typedef Varyings<F> VL;
+	unsigned int color = 0xFFFFFFFF;
+	if(F & SR_TEXCOORD0)
+		color = SampleTexture<P>(ctx.tex0, aw[VL::tex0], aw[VL::tex0 + 1], w);
+	if(F & SR_TEXCOORD1)
+		color = Modulate(color, SampleTexture<P>(ctx.tex1, aw[VL::tex1], aw[VL::tex1 + 1], w));
+	if(F & SR_COLOR)
+		color = Modulate(color, VertexColor<P>(&aw[VL::color], w));
+	if(F & SR_LIGHTING)
+		color = Modulate(color, Lighting(ctx, &aw[VL::normal]));
+	return color;
+}
+
+#ifdef __SSE2__
+/* [base, base+step, base+2*step, base+3*step], wrapping around like the scalar accumulators */
+static inline __m128i Ramp4(int base, int step)
+{
+	const unsigned int b = base;
+	const unsigned int s = step;
+	return _mm_setr_epi32(b, b + s, b + 2*s, b + 3*s);
+}
+
+static inline __m128i Step4(int step)
+{
+	return _mm_set1_epi32((int)(4u * (unsigned int)step));
+}
+
+static inline __m128i Select4(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//SSE2 has no pminsd and pmaxsd
+static inline __m128i Min4(__m128i a, __m128i b)
+{
+	return Select4(_mm_cmplt_epi32(a, b), a, b);
+}
+
+static inline __m128i Max4(__m128i a, __m128i b)
+{
+	return Select4(_mm_cmpgt_epi32(a, b), a, b);
+}
+
+/* ((long long)cw*w*(size-1)) >> 22, clamped to [0, size-1], for 4 pixels.
+   Done in double precision, where the products are exact for every coefficient
+   the setup produces. Truncating instead of shifting only differs for negative
+   coordinates, and those are clamped to 0 either way. */
+static inline __m128i TexCoord4(__m128i cw, __m128i w, __m128d scale, __m128i maxCoord)
+{
+	const __m128i cwHi = _mm_shuffle_epi32(cw, _MM_SHUFFLE(1, 0, 3, 2));
+	const __m128i wHi = _mm_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 3, 2));
+	__m128d lo = _mm_mul_pd(_mm_mul_pd(_mm_cvtepi32_pd(cw), _mm_cvtepi32_pd(w)), scale);
+	__m128d hi = _mm_mul_pd(_mm_mul_pd(_mm_cvtepi32_pd(cwHi), _mm_cvtepi32_pd(wHi)), scale);
+	__m128i c = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+	c = _mm_andnot_si128(_mm_srai_epi32(c, 31), c);
+	return Select4(_mm_cmpgt_epi32(c, maxCoord), maxCoord, c);
+}
+
+/* Modulate for 4 pixels */
+static inline __m128i Modulate4(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(255);
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+	return _mm_packus_epi16(lo, hi);
+}
+
+/* SampleTexture for 4 pixels, from the interpolated w and the u/w and v/w accumulators */
+template<class P>
+static inline __m128i Sample4(const BlitTexture& tex, __m128i w, __m128i uAccum, __m128i vAccum)
+{
+	const __m128i u = TexCoord4(_mm_srai_epi32(uAccum, P::Q*2), w, _mm_set1_pd(tex.uScale), _mm_set1_epi32(tex.iTw - 1));
+	const __m128i v = TexCoord4(_mm_srai_epi32(vAccum, P::Q*2), w, _mm_set1_pd(tex.vScale), _mm_set1_epi32(tex.iTh - 1));
+#ifdef __AVX2__
+	const __m128i idx = _mm_add_epi32(u, _mm_mullo_epi32(v, _mm_set1_epi32(tex.iTw)));
+	return _mm_i32gather_epi32((const int*)tex.tbuf, idx, 4);
+#else
+	int ui[4], vi[4];
+	_mm_storeu_si128((__m128i*)ui, u);
+	_mm_storeu_si128((__m128i*)vi, v);
+	const unsigned int* tbuf = tex.tbuf;
+	const int iTw = tex.iTw;
+	return _mm_setr_epi32(tbuf[ui[0] + vi[0]*iTw], tbuf[ui[1] + vi[1]*iTw],
+	                      tbuf[ui[2] + vi[2]*iTw], tbuf[ui[3] + vi[3]*iTw]);
+#endif
+}
+
+/* VertexColor for 4 pixels */
+template<class P>
+static inline __m128i VertexColor4(const BlitContext& ctx, __m128i w, const __m128i* cAccum)
+{
+	const __m128d scale = _mm_set1_pd(ctx.colorScale);
+	const __m128i maxColor = _mm_set1_epi32(255);
+	const __m128i r = TexCoord4(_mm_srai_epi32(cAccum[0], P::Q*2), w, scale, maxColor);
+	const __m128i g = TexCoord4(_mm_srai_epi32(cAccum[1], P::Q*2), w, scale, maxColor);
+	const __m128i b = TexCoord4(_mm_srai_epi32(cAccum[2], P::Q*2), w, scale, maxColor);
+	__m128i color = _mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8));
+	color = _mm_or_si128(color, b);
+	return _mm_or_si128(color, _mm_set1_epi32(0xFF000000));
+}
+
+/* Lighting for 4 pixels. Same operations in the same order, so the same result */
+template<class P>
+static inline __m128i Lighting4(const BlitContext& ctx, const __m128i* nAccum)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 nx = _mm_cvtepi32_ps(_mm_srai_epi32(nAccum[0], P::Q*2));
+	const __m128 ny = _mm_cvtepi32_ps(_mm_srai_epi32(nAccum[1], P::Q*2));
+	const __m128 nz = _mm_cvtepi32_ps(_mm_srai_epi32(nAccum[2], P::Q*2));
+	__m128 d = _mm_mul_ps(nx, _mm_set1_ps(ctx.lightX));
+	d = _mm_add_ps(d, _mm_mul_ps(ny, _mm_set1_ps(ctx.lightY)));
+	d = _mm_add_ps(d, _mm_mul_ps(nz, _mm_set1_ps(ctx.lightZ)));
+	__m128 len = _mm_mul_ps(nx, nx);
+	len = _mm_add_ps(len, _mm_mul_ps(ny, ny));
+	len = _mm_add_ps(len, _mm_mul_ps(nz, nz));
+	len = _mm_sqrt_ps(len);
+	const __m128 lit = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_cmpgt_ps(len, zero));
+	//Unlit lanes divide by 1 instead of 0, then get masked out
+	const __m128 safeLen = _mm_or_ps(_mm_and_ps(lit, len), _mm_andnot_ps(lit, _mm_set1_ps(1.0f)));
+	const __m128 diffuse = _mm_mul_ps(_mm_set1_ps(ctx.diffuse), _mm_div_ps(d, safeLen));
+	const __m128 l = _mm_add_ps(_mm_set1_ps(ctx.ambient), _mm_and_ps(lit, diffuse));
+	const __m128i i = _mm_cvttps_epi32(_mm_mul_ps(l, _mm_set1_ps(255.0f)));
+	__m128i color = _mm_or_si128(_mm_slli_epi32(i, 16), _mm_slli_epi32(i, 8));
+	color = _mm_or_si128(color, i);
+	return _mm_or_si128(color, _mm_set1_epi32(0xFF000000));
+}
+
+/* ShadePixel for 4 pixels, from the w and varying accumulators */
+template<class P, unsigned int F>
+static inline __m128i Shade4(const BlitContext& ctx, __m128i wAccum, const __m128i* aAccum)
+{
+	typedef Varyings<F> VL;
+	const __m128i w = _mm_srai_epi32(wAccum, P::Q*2);
+	__m128i color = _mm_set1_epi32(0xFFFFFFFF);
+	if(F & SR_TEXCOORD0)
+		color = Sample4<P>(ctx.tex0, w, aAccum[VL::tex0], aAccum[VL::tex0 + 1]);
+	if(F & SR_TEXCOORD1)
+		color = Modulate4(color, Sample4<P>(ctx.tex1, w, aAccum[VL::tex1], aAccum[VL::tex1 + 1]));
+	if(F & SR_COLOR)
+		color = Modulate4(color, VertexColor4<P>(ctx, w, &aAccum[VL::color]));
+	if(F & SR_LIGHTING)
+		color = Modulate4(color, Lighting4<P>(ctx, &aAccum[VL::normal]));
+	return color;
+}
+
+/* 16-bit z-test for 4 pixels, with z clamped to [0, 65535] like the scalar path */
+template<class P>
+static inline __m128i DepthTest4(const unsigned short* depth, __m128i zAccum, bool equal, __m128i& z, __m128i& zbuf)
+{
+	const __m128i far = _mm_set1_epi32(P::depth_max);
+	z = Min4(Max4(_mm_srai_epi32(zAccum, P::Q*2), _mm_setzero_si128()), far);
+	zbuf = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)depth), _mm_setzero_si128());
+	return equal ? _mm_andnot_si128(_mm_cmpeq_epi32(z, far), _mm_cmpeq_epi32(z, zbuf)) : _mm_cmplt_epi32(z, zbuf);
+}
+
+/* Packs 4 depth values in [0, 65535] to unsigned short.
+   packs saturates signed, so move into the signed range and back */
+static inline void StoreDepth4(unsigned short* depth, __m128i z)
+{
+	z = _mm_sub_epi32(z, _mm_set1_epi32(0x8000));
+	z = _mm_xor_si128(_mm_packs_epi32(z, z), _mm_set1_epi16((short)0x8000));
+	_mm_storel_epi64((__m128i*)depth, z);
+}
+
+/* floor(z) of the 2 values in z, which are in [0, 2^32>, in the low 2 lanes.
+   Biased by 2^31, so signed compares order them like unsigned ones */
+static inline __m128i TruncBiased2(__m128d z)
+{
+	//Values from 2^31 are wrapped into the int range. Both halves subtract exactly
+	const __m128d wrap = _mm_and_pd(_mm_cmpge_pd(z, _mm_set1_pd(2147483648.0)), _mm_set1_pd(4294967296.0));
+	const __m128d b = _mm_sub_pd(z, wrap);
+	const __m128i t = _mm_cvttpd_epi32(b);
+	//Truncation rounds negative values up, take one off where it did
+	const __m128d up = _mm_cmpgt_pd(_mm_cvtepi32_pd(t), b);
+	const __m128i r = _mm_add_epi32(t, _mm_shuffle_epi32(_mm_castpd_si128(up), _MM_SHUFFLE(3, 3, 2, 0)));
+	return _mm_xor_si128(r, _mm_set1_epi32(0x80000000));
+}
+#endif
+
+/* Steps the depth of a tile through its pixels, row by row. BeginRow sets up
+   the row for the scalar loops, or for 4 pixels at a time with SSE2.
+   Passes and Test4 do the depth test of the format, or the equal one.
+   Depth is clamped to the range of the format. A multisampled pixel whose
+   center is outside the triangle gets extrapolated depth, which can end up
+   at the far value. That fails the less test even against a cleared buffer,
+   so the equal one leaves the far value out too, and passes exactly where
+   a depth pass could have written z. */
+template<class P, class D>
+struct DepthStepper;
+
+template<class P>
+struct DepthStepper<P, Depth16> {
+	//Same accumulators as the varyings
+	int slopeY0, slopeY1;
+	int accumY0, accumY1;
+	int slopeX, accumX;
+	bool equal;
+#ifdef __SSE2__
+	__m128i zAccum, zStep;
+#endif
+
+	void Begin(const BlitContext& ctx, const Tile& t)
+	{
+		equal = ctx.depthEqual;
+		slopeY0 = t.bz1 - t.bz0;
+		slopeY1 = t.bz3 - t.bz2;
+		accumY0 = t.bz0 << P::Q;
+		accumY1 = t.bz2 << P::Q;
+	}
+	void BeginRow()
+	{
+		slopeX = accumY1 - accumY0;
+		accumX = accumY0 << P::Q;
+#ifdef __SSE2__
+		zAccum = Ramp4(accumX, slopeX);
+		zStep = Step4(slopeX);
+#endif
+	}
+	void NextRow()
+	{
+		accumY0 += slopeY0;
+		accumY1 += slopeY1;
+	}
+	unsigned short Get() const { return (unsigned short)clamp(accumX >> (P::Q*2), 0, (int)P::depth_max); }
+	void Next() { accumX += slopeX; }
+	bool Passes(unsigned short z, unsigned short zbuf) const
+	{
+		return equal ? z == zbuf && z != P::depth_max : Depth16::Passes(z, zbuf);
 	}
-	int count;
-	std::vector<Tile> tiles;
+#ifdef __SSE2__
+	__m128i Test4(const unsigned short* depth, __m128i& z, __m128i& zbuf) const
+	{
+		return DepthTest4<P>(depth, zAccum, equal, z, zbuf);
+	}
+	static void Store4(unsigned short* depth, __m128i z) { StoreDepth4(depth, z); }
+	void Next4() { zAccum = _mm_add_epi32(zAccum, zStep); }
+#endif
+};
+
+/* The wide formats. Every depth is evaluated from the plane rather than
+   accumulated, so the scalar and SIMD loops get the same values */
+template<class D>
+struct PlaneDepthStepper {
+	typedef typename D::Type Type;
+	double z0, dzdx, dzdy;
+	double depthMax;
+	double row; //depth at the start of the row
+	int iy, ix;
+	bool equal;
+	Type far; //the depth of the far plane, what the buffer is cleared to
+
+	void Begin(const BlitContext& ctx, const Tile& t)
+	{
+		equal = ctx.depthEqual;
+		z0 = t.dz0;
+		dzdx = t.dzdx;
+		dzdy = t.dzdy;
+		depthMax = ctx.depthMax;
+		far = D::reversed ? (Type)0 : (Type)depthMax;
+		iy = 0;
+	}
+	void BeginRow()
+	{
+		row = z0 + iy * dzdy;
+		ix = 0;
+	}
+	void NextRow() { ++iy; }
+	Type Get() const { return (Type)clamp(row + ix * dzdx, 0.0, depthMax); }
+	void Next() { ++ix; }
+	bool Passes(Type z, Type zbuf) const { return equal ? z == zbuf && z != far : D::Passes(z, zbuf); }
+#ifdef __SSE2__
+	//Depth of pixels ix + i and ix + i + 1 of the row
+	__m128d Lanes2(int i) const
+	{
+		const __m128d z = _mm_add_pd(_mm_set1_pd(row), _mm_mul_pd(_mm_set_pd(ix + i + 1, ix + i), _mm_set1_pd(dzdx)));
+		return _mm_min_pd(_mm_max_pd(z, _mm_setzero_pd()), _mm_set1_pd(depthMax));
+	}
+	void Next4() { ix += 4; }
+#endif
 };
 
-static std::vector<TileSet> wc_tileListFilled; //completely filled tiles
-static std::vector<TileSet> wc_tileList; //Partially filled
+template<class P>
+struct DepthStepper<P, DepthFixed> : PlaneDepthStepper<DepthFixed> {
+#ifdef __SSE2__
+	//z and zbuf are biased by 2^31 for the signed compare
+	__m128i Test4(const unsigned int* depth, __m128i& z, __m128i& zbuf) const
+	{
+		z = _mm_unpacklo_epi64(TruncBiased2(Lanes2(0)), TruncBiased2(Lanes2(2)));
+		zbuf = _mm_xor_si128(_mm_loadu_si128((const __m128i*)depth), _mm_set1_epi32(0x80000000));
+		if(!this->equal)
+			return _mm_cmplt_epi32(z, zbuf);
+		const __m128i far = _mm_set1_epi32((int)(this->far ^ 0x80000000u));
+		return _mm_andnot_si128(_mm_cmpeq_epi32(z, far), _mm_cmpeq_epi32(z, zbuf));
+	}
+	static void Store4(unsigned int* depth, __m128i z)
+	{
+		_mm_storeu_si128((__m128i*)depth, _mm_xor_si128(z, _mm_set1_epi32(0x80000000)));
+	}
+#endif
+};
+
+template<class P>
+struct DepthStepper<P, DepthFloat> : PlaneDepthStepper<DepthFloat> {
+#ifdef __SSE2__
+	__m128i Test4(const float* depth, __m128i& z, __m128i& zbuf) const
+	{
+		const __m128 zf = _mm_movelh_ps(_mm_cvtpd_ps(Lanes2(0)), _mm_cvtpd_ps(Lanes2(2)));
+		const __m128 zbuff = _mm_loadu_ps(depth);
+		z = _mm_castps_si128(zf);
+		zbuf = _mm_castps_si128(zbuff);
+		if(!this->equal)
+			return _mm_castps_si128(_mm_cmpgt_ps(zf, zbuff));
+		return _mm_castps_si128(_mm_and_ps(_mm_cmpneq_ps(zf, _mm_set1_ps(this->far)), _mm_cmpeq_ps(zf, zbuff)));
+	}
+	static void Store4(float* depth, __m128i z) { _mm_storeu_si128((__m128i*)depth, z); }
+#endif
+};
 
-void BlitTilesFilled()
+#ifdef __SSE2__
+
+/* Number of bits set in a 4 bit mask, from a table of nibbles */
+static inline int BitCount4(int mask)
 {
-	unsigned int* colorbuffer = wc_colorbuffer->Lock();
-	unsigned short* depthbuffer = wc_depthbuffer->Ptr();
-	const unsigned int width = wc_colorbuffer->w;
-	const unsigned int height = wc_colorbuffer->h;
-	const unsigned int numTilesX = (width >> Q);
-	const unsigned int numTilesY = (height >> Q);
-	const int iTw = wc_texture0->width;
-	const int iTh = wc_texture0->height;
-	const unsigned int* tbuf = &wc_texture0->texels[0];
-	for(int y = 0; y < height; y+= q) {
-		for(int x = 0; x < width; x+= q) {
-			const int tileX = x >> Q;
-			const int tileY = y >> Q;
-			TileSet& tileSet = wc_tileListFilled[tileX + tileY*numTilesX];
-			if(tileSet.tiles.empty()) continue;
-#if 0
-			//The cover optimization doesn't always work,
-			//and very few tiles have 100% cover, so it was
-			//a lot of effort for little gain. Disabled for now
-			//It's maybe worth to use in very specific scenes, with a high resolution
-			//NOTE: The sorting probably spends more time than we save, but the idea
-			//also works without sorting, just sub-optimal.
-			int zMin0 = 0;
-			int zMax0 = 65535;
-			std::sort(tileSet.tiles.begin(), tileSet.tiles.begin() + tileSet.count);
+	return (int)((0x4332322132212110ULL >> (mask * 4)) & 0xF);
+}
+
+/* One row of a fully covered tile, 4 pixels at a time. No edge tests are needed,
+   so every lane is shaded and only the z-test masks the stores.
+   Returns the number of pixels that passed when counting samples. */
+template<class P, unsigned int F, class D>
+static inline int BlitRowFilled4(const BlitContext& ctx, int fbIndex, bool zTest, DepthStepper<P, D> zs,
+                                  int bw, const int* ba, int bwSlope, const int* baSlope)
+{
+	const int V = Varyings<F>::count;
+	unsigned int* colorbuffer = ctx.colorbuffer;
+	typename D::Type* depthbuffer = static_cast<typename D::Type*>(ctx.depthbuffer);
+	__m128i wAccum = Ramp4(bw, bwSlope);
+	__m128i aAccum[maxVaryings];
+	__m128i aStep[maxVaryings];
+	const __m128i wStep = Step4(bwSlope);
+	for(int k = 0; k < V; ++k) {
+		aAccum[k] = Ramp4(ba[k], baSlope[k]);
+		aStep[k] = Step4(baSlope[k]);
+	}
+
+	int passed = 0;
+	for(int ix = 0; ix < P::q; ix += 4, fbIndex += 4) {
+		__m128i z, zbuf;
+		__m128i pass = zs.Test4(&depthbuffer[fbIndex], z, zbuf);
+		if(!zTest) {
+			if(ctx.depthWrite)
+				zs.Store4(&depthbuffer[fbIndex], z);
+			if(!(F & SR_DEPTH_ONLY))
+				_mm_storeu_si128((__m128i*)&colorbuffer[fbIndex], Shade4<P, F>(ctx, wAccum, aAccum));
+			passed += 4;
+		} else if(const int mask = _mm_movemask_ps(_mm_castsi128_ps(pass))) {
+			if(ctx.depthWrite)
+				zs.Store4(&depthbuffer[fbIndex], Select4(pass, z, zbuf));
+			if(ctx.countSamples)
+				passed += BitCount4(mask);
+			if(!(F & SR_DEPTH_ONLY)) {
+				__m128i cold = _mm_loadu_si128((const __m128i*)&colorbuffer[fbIndex]);
+				__m128i cnew = Select4(pass, Shade4<P, F>(ctx, wAccum, aAccum), cold);
+				_mm_storeu_si128((__m128i*)&colorbuffer[fbIndex], cnew);
+			}
+		}
+		wAccum = _mm_add_epi32(wAccum, wStep);
+		zs.Next4();
+		for(int k = 0; k < V; ++k)
+			aAccum[k] = _mm_add_epi32(aAccum[k], aStep[k]);
+	}
+	return passed;
+}
+
+/* One row of a partially covered tile, 4 pixels at a time.
+   The edge functions and the z-test build a coverage mask, then depth and color
+   are written with masked stores. The accumulators take the same values as
+   in the scalar loop, so the output is identical. Returns like BlitRowFilled4. */
+template<class P, unsigned int F, class D>
+static inline int BlitRowPartial4(const BlitContext& ctx, int fbIndex,
+                                   int CX1, int CX2, int CX3,
+                                   int FDY12, int FDY23, int FDY31, DepthStepper<P, D> zs,
+                                   int bw, const int* ba, int bwSlope, const int* baSlope)
+{
+	const int V = Varyings<F>::count;
+	unsigned int* colorbuffer = ctx.colorbuffer;
+	typename D::Type* depthbuffer = static_cast<typename D::Type*>(ctx.depthbuffer);
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i cx1 = Ramp4(CX1, -FDY12);
+	__m128i cx2 = Ramp4(CX2, -FDY23);
+	__m128i cx3 = Ramp4(CX3, -FDY31);
+	__m128i wAccum = Ramp4(bw, bwSlope);
+	__m128i aAccum[maxVaryings];
+	__m128i aStep[maxVaryings];
+	const __m128i cx1Step = Step4(-FDY12);
+	const __m128i cx2Step = Step4(-FDY23);
+	const __m128i cx3Step = Step4(-FDY31);
+	const __m128i wStep = Step4(bwSlope);
+	for(int k = 0; k < V; ++k) {
+		aAccum[k] = Ramp4(ba[k], baSlope[k]);
+		aStep[k] = Step4(baSlope[k]);
+	}
+
+	int passed = 0;
+	for(int ix = 0; ix < P::q; ix += 4, fbIndex += 4) {
+		__m128i z, zbuf;
+		__m128i covered = _mm_and_si128(_mm_cmpgt_epi32(cx1, zero), _mm_cmpgt_epi32(cx2, zero));
+		covered = _mm_and_si128(covered, _mm_cmpgt_epi32(cx3, zero));
+		covered = _mm_and_si128(covered, zs.Test4(&depthbuffer[fbIndex], z, zbuf));
+		if(const int mask = _mm_movemask_ps(_mm_castsi128_ps(covered))) {
+			if(ctx.depthWrite)
+				zs.Store4(&depthbuffer[fbIndex], Select4(covered, z, zbuf));
+			if(ctx.countSamples)
+				passed += BitCount4(mask);
+			if(!(F & SR_DEPTH_ONLY)) {
+				__m128i cold = _mm_loadu_si128((const __m128i*)&colorbuffer[fbIndex]);
+				__m128i cnew = Select4(covered, Shade4<P, F>(ctx, wAccum, aAccum), cold);
+				_mm_storeu_si128((__m128i*)&colorbuffer[fbIndex], cnew);
+			}
+		}
+		cx1 = _mm_add_epi32(cx1, cx1Step);
+		cx2 = _mm_add_epi32(cx2, cx2Step);
+		cx3 = _mm_add_epi32(cx3, cx3Step);
+		wAccum = _mm_add_epi32(wAccum, wStep);
+		zs.Next4();
+		for(int k = 0; k < V; ++k)
+			aAccum[k] = _mm_add_epi32(aAccum[k], aStep[k]);
+	}
+	return passed;
+}
 #endif
-			for(int i = 0; i < tileSet.count; ++i) {
-				Tile& t = tileSet.tiles[i];
-				int zMin1 = t.zMin;
-				int zMax1 = t.zMax;
-				bool skipZTest = false;
-#if 0
-				// z < buffer (65535)
-				if(zMin1 > zMax0) {
-					// Occluded anyway, so skip
-					continue;
-				} else if(zMax1 > zMax0 && zMin1 < zMax0) {
-					// Intersecting
-					//zMax0 = zMax1;
-					zMin0 = std::min(zMin0, zMin1);
-					skipZTest = false;
-				} else if(zMax1 < zMin0) {
-					zMax0 = zMax1;
-					zMin0 = zMin1;
-					// totally at the front, so no need to z test
-					skipZTest = true;
+
+/* Sets up the tile of ref at pixel (x, y), and the depth plane for the wide depth formats */
+template<class P, unsigned int F, class D>
+static inline void SetupTileRef(const BlitContext& ctx, const TileRef& ref, int x, int y, Tile& t)
+{
+	const TriangleSetup& tri = ctx.triangles[ref.tri];
+	const int* coeffs = ctx.varyingCoeffs + ref.tri * 3 * Varyings<F>::count;
+	SetupTile<P, F>(tri, coeffs, x, y, ctx.NDC_x_step, ctx.NDC_y_step, t);
+	if(D::planar) {
+		const double ndcScale = 1.0 / (double)P::i_ndc_precision;
+		const double NDC_x0 = (double)(x * ctx.NDC_x_step - P::i_ndc_precision) * ndcScale;
+		const double NDC_y0 = (double)(y * ctx.NDC_y_step - P::i_ndc_precision) * ndcScale;
+		t.dz0 = ((double)tri.zA * NDC_x0 + (double)tri.zB * NDC_y0 + (double)tri.zC) * ctx.depthScale;
+		t.dzdx = (double)tri.zA * (ctx.NDC_x_step * ndcScale) * ctx.depthScale;
+		t.dzdy = (double)tri.zB * (ctx.NDC_y_step * ndcScale) * ctx.depthScale;
+	}
+}
+
+/* Blits the filled tiles of a screen tile. Returns the number of pixels
+   that passed the depth test when counting samples */
+template<class P, unsigned int F, class D>
+static unsigned int BlitTileFilled(const BlitContext& ctx, TileSet& tileSet, int x, int y, int& zMin0, int& zMax0)
+{
+	const int V = Varyings<F>::count;
+	const unsigned int width = ctx.width;
+#ifndef __SSE2__
+	unsigned int* colorbuffer = ctx.colorbuffer;
+	typename D::Type* depthbuffer = static_cast<typename D::Type*>(ctx.depthbuffer);
+#endif
+	unsigned int passed = 0;
+	for(TileSet::Iterator it = tileSet.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		bool skipZTest = false;
+		if(!FilledTileVisible<P>(ctx, ref, zMin0, zMax0, skipZTest))
+			continue;
+		Tile t;
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		DepthStepper<P, D> zs;
+		zs.Begin(ctx, t);
+		//Gradients for y interpolation
+		const int bwSlopeY0 = t.bw1 - t.bw0;
+		const int bwSlopeY1 = t.bw3 - t.bw2;
+		int baSlopeY0[maxVaryings];
+		int baSlopeY1[maxVaryings];
+		//Accumulators (actual interpolated value) for y
+		int bwSlopeYAccum0 = t.bw0 << P::Q;
+		int bwSlopeYAccum1 = t.bw2 << P::Q;
+		int baSlopeYAccum0[maxVaryings];
+		int baSlopeYAccum1[maxVaryings];
+		for(int k = 0; k < V; ++k) {
+			baSlopeY0[k] = t.ba[k][1] - t.ba[k][0];
+			baSlopeY1[k] = t.ba[k][3] - t.ba[k][2];
+			baSlopeYAccum0[k] = t.ba[k][0] << P::Q;
+			baSlopeYAccum1[k] = t.ba[k][2] << P::Q;
+		}
+		int col = y*width;
+		for(int iy = y; iy < y+P::q; ++iy) {
+			//Gradients for x interpolation
+			const int bwSlopeX0 = bwSlopeYAccum1 - bwSlopeYAccum0;
+			int baSlopeX0[maxVaryings];
+			//Accumulators (actual interpolated value) for x
+			int bwSlopeXAccum0 = bwSlopeYAccum0 << P::Q;
+			zs.BeginRow();
+			int baSlopeXAccum0[maxVaryings];
+			for(int k = 0; k < V; ++k) {
+				baSlopeX0[k] = baSlopeYAccum1[k] - baSlopeYAccum0[k];
+				baSlopeXAccum0[k] = baSlopeYAccum0[k] << P::Q;
+			}
+			int fbIndex = x+col;
+#ifdef __SSE2__
+			passed += BlitRowFilled4<P, F, D>(ctx, fbIndex, !skipZTest, zs,
+			                                  bwSlopeXAccum0, baSlopeXAccum0, bwSlopeX0, baSlopeX0);
+#else
+			for(int ix = x; ix < x+P::q; ++ix) {
+				const typename D::Type z = zs.Get();
+				if(skipZTest || zs.Passes(z, depthbuffer[fbIndex])) {
+					if(ctx.depthWrite)
+						depthbuffer[fbIndex] = z;
+					++passed;
+					if(!(F & SR_DEPTH_ONLY)) {
+						int aw[maxVaryings];
+						for(int k = 0; k < V; ++k)
+							aw[k] = baSlopeXAccum0[k] >> (P::Q*2);
+						colorbuffer[fbIndex] = ShadePixel<P, F>(ctx, bwSlopeXAccum0 >> (P::Q*2), aw);
+					}
 				}
+				++fbIndex;
+				bwSlopeXAccum0 += bwSlopeX0;
+				zs.Next();
+				for(int k = 0; k < V; ++k)
+					baSlopeXAccum0[k] += baSlopeX0[k];
+			}
+#endif
+			bwSlopeYAccum0 += bwSlopeY0;
+			bwSlopeYAccum1 += bwSlopeY1;
+			zs.NextRow();
+			for(int k = 0; k < V; ++k) {
+				baSlopeYAccum0[k] += baSlopeY0[k];
+				baSlopeYAccum1[k] += baSlopeY1[k];
+			}
+			col += width;
+		}
+	}
+	return passed;
+}
+
+/* Like BlitTileFilled, for the partially covered tiles */
+template<class P, unsigned int F, class D>
+static unsigned int BlitTilePartial(const BlitContext& ctx, TileSet& tileSet, int x, int y, int& zMin0, int& zMax0)
+{
+	const int V = Varyings<F>::count;
+	const unsigned int width = ctx.width;
+#ifndef __SSE2__
+	unsigned int* colorbuffer = ctx.colorbuffer;
+	typename D::Type* depthbuffer = static_cast<typename D::Type*>(ctx.depthbuffer);
 #endif
-				//Gradients for y interpolation
-				const int bwSlopeY0 = t.bw1 - t.bw0;
-				const int bwSlopeY1 = t.bw3 - t.bw2;
-				const int bzSlopeY0 = t.bz1 - t.bz0;
-				const int bzSlopeY1 = t.bz3 - t.bz2;
-				const int buSlopeY0 = t.bu1 - t.bu0;
-				const int buSlopeY1 = t.bu3 - t.bu2;
-				const int bvSlopeY0 = t.bv1 - t.bv0;
-				const int bvSlopeY1 = t.bv3 - t.bv2;
-				//Accumulators (actual interpolated value) for y
-				int bwSlopeYAccum0 = t.bw0 << Q;
-				int bwSlopeYAccum1 = t.bw2 << Q;
-				int bzSlopeYAccum0 = t.bz0 << Q;
-				int bzSlopeYAccum1 = t.bz2 << Q;
-				int buSlopeYAccum0 = t.bu0 << Q;
-				int buSlopeYAccum1 = t.bu2 << Q;
-				int bvSlopeYAccum0 = t.bv0 << Q;
-				int bvSlopeYAccum1 = t.bv2 << Q;
-				int col = y*width;
-				for(int iy = y; iy < y+q; ++iy) {
-					//Gradients for x interpolation
-					const int bwSlopeX0 = bwSlopeYAccum1 - bwSlopeYAccum0;
-					const int bzSlopeX0 = bzSlopeYAccum1 - bzSlopeYAccum0;
-					const int buSlopeX0 = buSlopeYAccum1 - buSlopeYAccum0;
-					const int bvSlopeX0 = bvSlopeYAccum1 - bvSlopeYAccum0;
-					//Accumulators (actual interpolated value) for x
-					int bwSlopeXAccum0 = bwSlopeYAccum0 << Q;
-					int bzSlopeXAccum0 = bzSlopeYAccum0 << Q;
-					int buSlopeXAccum0 = buSlopeYAccum0 << Q;
-					int bvSlopeXAccum0 = bvSlopeYAccum0 << Q;
-					int fbIndex = x+col;
-					if(skipZTest) {
-						for(int ix = x; ix < x+q; ++ix) {
-							unsigned short z = bzSlopeXAccum0 >> (Q*2);
+	unsigned int passed = 0;
+
+	for(TileSet::Iterator it = tileSet.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		if(!PartialTileVisible<P>(ctx, ref, zMin0, zMax0))
+			continue;
+		Tile t;
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		DepthStepper<P, D> zs;
+		zs.Begin(ctx, t);
+		//Gradients for y interpolation
+		const int bwSlopeY0 = t.bw1 - t.bw0;
+		const int bwSlopeY1 = t.bw3 - t.bw2;
+		int baSlopeY0[maxVaryings];
+		int baSlopeY1[maxVaryings];
+		const int FDY12 = t.FDY12;
+		const int FDY23 = t.FDY23;
+		const int FDY31 = t.FDY31;
+		const int FDX12 = t.FDX12;
+		const int FDX23 = t.FDX23;
+		const int FDX31 = t.FDX31;
+		//Accumulators (actual interpolated value) for y
+		int bwSlopeYAccum0 = t.bw0 << P::Q;
+		int bwSlopeYAccum1 = t.bw2 << P::Q;
+		int baSlopeYAccum0[maxVaryings];
+		int baSlopeYAccum1[maxVaryings];
+		for(int k = 0; k < V; ++k) {
+			baSlopeY0[k] = t.ba[k][1] - t.ba[k][0];
+			baSlopeY1[k] = t.ba[k][3] - t.ba[k][2];
+			baSlopeYAccum0[k] = t.ba[k][0] << P::Q;
+			baSlopeYAccum1[k] = t.ba[k][2] << P::Q;
+		}
+		int CY1 = t.CY1;
+		int CY2 = t.CY2;
+		int CY3 = t.CY3;
+		int col = y*width;
+		for(int iy = y; iy < y+P::q; ++iy) {
+			int CX1 = CY1;
+			int CX2 = CY2;
+			int CX3 = CY3;
+			//Gradients for x interpolation
+			const int bwSlopeX0 = bwSlopeYAccum1 - bwSlopeYAccum0;
+			int baSlopeX0[maxVaryings];
+			//Accumulators (actual interpolated value) for x
+			int bwSlopeXAccum0 = bwSlopeYAccum0 << P::Q;
+			zs.BeginRow();
+			int baSlopeXAccum0[maxVaryings];
+			for(int k = 0; k < V; ++k) {
+				baSlopeX0[k] = baSlopeYAccum1[k] - baSlopeYAccum0[k];
+				baSlopeXAccum0[k] = baSlopeYAccum0[k] << P::Q;
+			}
+			int fbIndex = x + col;
+#ifdef __SSE2__
+			passed += BlitRowPartial4<P, F, D>(ctx, fbIndex, CX1, CX2, CX3, FDY12, FDY23, FDY31, zs,
+			                                   bwSlopeXAccum0, baSlopeXAccum0, bwSlopeX0, baSlopeX0);
+#else
+			for(int ix = x; ix < x+P::q; ++ix) {
+				if(CX1 > 0 && CX2 > 0 && CX3 > 0) {
+					const typename D::Type z = zs.Get();
+					if(zs.Passes(z, depthbuffer[fbIndex])) {
+						if(ctx.depthWrite)
 							depthbuffer[fbIndex] = z;
-							int uw = buSlopeXAccum0>>(Q*2);
-							int vw = bvSlopeXAccum0>>(Q*2);
-							int w = bwSlopeXAccum0>>(Q*2);
-							int u = ((long long)uw*w*(iTw - 1)) >> (coeff_precision_base * 2);
-							int v = ((long long)vw*w*(iTh - 1)) >> (coeff_precision_base * 2);
-							u = clamp((int)u, 0, iTw-1);
-							v = clamp((int)v, 0, iTh-1);
-							int idxTex = u + v*iTw;
-							colorbuffer[fbIndex] = tbuf[idxTex];
-							++fbIndex;
-							bwSlopeXAccum0 += bwSlopeX0;
-							bzSlopeXAccum0 += bzSlopeX0;
-							buSlopeXAccum0 += buSlopeX0;
-							bvSlopeXAccum0 += bvSlopeX0;
-						}
-					} else {
-						for(int ix = x; ix < x+q; ++ix) {
-							unsigned short z = bzSlopeXAccum0 >> (Q*2);
-							if(z < depthbuffer[fbIndex]) {
-								depthbuffer[fbIndex] = z;
-								int uw = buSlopeXAccum0>>(Q*2);
-								int vw = bvSlopeXAccum0>>(Q*2);
-								int w = bwSlopeXAccum0>>(Q*2);
-								int u = ((long long)uw*w*(iTw - 1)) >> (coeff_precision_base * 2);
-								int v = ((long long)vw*w*(iTh - 1)) >> (coeff_precision_base * 2);
-								u = clamp((int)u, 0, iTw-1);
-								v = clamp((int)v, 0, iTh-1);
-								int idxTex = u + v*iTw;
-								colorbuffer[fbIndex] = tbuf[idxTex];
-							}
-							++fbIndex;
-							bwSlopeXAccum0 += bwSlopeX0;
-							bzSlopeXAccum0 += bzSlopeX0;
-							buSlopeXAccum0 += buSlopeX0;
-							bvSlopeXAccum0 += bvSlopeX0;
+						++passed;
+						if(!(F & SR_DEPTH_ONLY)) {
+							int aw[maxVaryings];
+							for(int k = 0; k < V; ++k)
+								aw[k] = baSlopeXAccum0[k] >> (P::Q*2);
+							colorbuffer[fbIndex] = ShadePixel<P, F>(ctx, bwSlopeXAccum0 >> (P::Q*2), aw);
 						}
 					}
-					bwSlopeYAccum0 += bwSlopeY0;
-					bwSlopeYAccum1 += bwSlopeY1;
-					bzSlopeYAccum0 += bzSlopeY0;
-					bzSlopeYAccum1 += bzSlopeY1;
-					buSlopeYAccum0 += buSlopeY0;
-					buSlopeYAccum1 += buSlopeY1;
-					bvSlopeYAccum0 += bvSlopeY0;
-					bvSlopeYAccum1 += bvSlopeY1;
-					col += width;
 				}
+				++fbIndex;
+				bwSlopeXAccum0 += bwSlopeX0;
+				zs.Next();
+				for(int k = 0; k < V; ++k)
+					baSlopeXAccum0[k] += baSlopeX0[k];
+				CX1 -= FDY12;
+				CX2 -= FDY23;
+				CX3 -= FDY31;
 			}
+#endif
+			bwSlopeYAccum0 += bwSlopeY0;
+			bwSlopeYAccum1 += bwSlopeY1;
+			zs.NextRow();
+			for(int k = 0; k < V; ++k) {
+				baSlopeYAccum0[k] += baSlopeY0[k];
+				baSlopeYAccum1[k] += baSlopeY1[k];
+			}
+			CY1 += FDX12;
+			CY2 += FDX23;
+			CY3 += FDX31;
+			col += width;
 		}
 	}
-	wc_colorbuffer->Unlock();
+	return passed;
 }
 
-void BlitTiles()
+/* Value of a bilinearly interpolated corner attribute at pixel (ix, iy) of the
+   tile. The same value the blit loops reach by stepping, wraparound included. */
+template<class P>
+static inline int TileLerp(int b0, int b1, int b2, int b3, int ix, int iy)
 {
-	unsigned int* colorbuffer = wc_colorbuffer->Lock();
-	unsigned short* depthbuffer = wc_depthbuffer->Ptr();
-	const unsigned int width = wc_colorbuffer->w;
-	const unsigned int height = wc_colorbuffer->h;
-	const unsigned int numTilesX = (width >> Q);
-	const unsigned int numTilesY = (height >> Q);
-	const int iTw = wc_texture0->width;
-	const int iTh = wc_texture0->height;
-	const unsigned int* tbuf = &wc_texture0->texels[0];
-
-	for(int y = 0; y < height; y+= q) {
-		for(int x = 0; x < width; x+= q) {
-			const int tileX = x >> Q;
-			const int tileY = y >> Q;
-			TileSet& tileSet = wc_tileList[tileX + tileY*numTilesX];
-			if(tileSet.tiles.empty()) continue;
-			for(int i = 0; i < tileSet.count; ++i) {
-				Tile& t = tileSet.tiles[i];
-				//Gradients for y interpolation
-				const int bwSlopeY0 = t.bw1 - t.bw0;
-				const int bwSlopeY1 = t.bw3 - t.bw2;
-				const int bzSlopeY0 = t.bz1 - t.bz0;
-				const int bzSlopeY1 = t.bz3 - t.bz2;
-				const int buSlopeY0 = t.bu1 - t.bu0;
-				const int buSlopeY1 = t.bu3 - t.bu2;
-				const int bvSlopeY0 = t.bv1 - t.bv0;
-				const int bvSlopeY1 = t.bv3 - t.bv2;
-				const int FDY12 = t.FDY12;
-				const int FDY23 = t.FDY23;
-				const int FDY31 = t.FDY31;
-				const int FDX12 = t.FDX12;
-				const int FDX23 = t.FDX23;
-				const int FDX31 = t.FDX31;
-				//Accumulators (actual interpolated value) for y
-				int bwSlopeYAccum0 = t.bw0 << Q;
-				int bwSlopeYAccum1 = t.bw2 << Q;
-				int bzSlopeYAccum0 = t.bz0 << Q;
-				int bzSlopeYAccum1 = t.bz2 << Q;
-				int buSlopeYAccum0 = t.bu0 << Q;
-				int buSlopeYAccum1 = t.bu2 << Q;
-				int bvSlopeYAccum0 = t.bv0 << Q;
-				int bvSlopeYAccum1 = t.bv2 << Q;
-				int CY1 = t.CY1;
-				int CY2 = t.CY2;
-				int CY3 = t.CY3;
-				int col = y*width;
-				for(int iy = y; iy < y+q; ++iy) {
-					int CX1 = CY1;
-					int CX2 = CY2;
-					int CX3 = CY3;
-					//Gradients for x interpolation
-					const int bwSlopeX0 = bwSlopeYAccum1 - bwSlopeYAccum0;
-					const int bzSlopeX0 = bzSlopeYAccum1 - bzSlopeYAccum0;
-					const int buSlopeX0 = buSlopeYAccum1 - buSlopeYAccum0;
-					const int bvSlopeX0 = bvSlopeYAccum1 - bvSlopeYAccum0;
-					//Accumulators (actual interpolated value) for x
-					int bwSlopeXAccum0 = bwSlopeYAccum0 << Q;
-					int bzSlopeXAccum0 = bzSlopeYAccum0 << Q;
-					int buSlopeXAccum0 = buSlopeYAccum0 << Q;
-					int bvSlopeXAccum0 = bvSlopeYAccum0 << Q;
-					int fbIndex = x + col;
-					for(int ix = x; ix < x+q; ++ix) {
-						if(CX1 > 0 && CX2 > 0 && CX3 > 0) {
-							unsigned short z = bzSlopeXAccum0 >> (Q*2);
-							if(z < depthbuffer[fbIndex]) {
-								depthbuffer[fbIndex] = z;
-								int uw = buSlopeXAccum0>>(Q*2);
-								int vw = bvSlopeXAccum0>>(Q*2);
-								int w = bwSlopeXAccum0>>(Q*2);
-								int u = ((long long)uw*w*(iTw - 1)) >> (coeff_precision_base * 2);
-								int v = ((long long)vw*w*(iTh - 1)) >> (coeff_precision_base * 2);
-								u = clamp((int)u, 0, iTw-1);
-								v = clamp((int)v, 0, iTh-1);
-								int idxTex = u + v*iTw;
-								colorbuffer[fbIndex] = tbuf[idxTex];
-							}
-						}
-						++fbIndex;
-						bwSlopeXAccum0 += bwSlopeX0;
-						bzSlopeXAccum0 += bzSlopeX0;
-						buSlopeXAccum0 += buSlopeX0;
-						bvSlopeXAccum0 += bvSlopeX0;
-						CX1 -= FDY12;
-						CX2 -= FDY23;
-						CX3 -= FDY31;
-					}
-					bwSlopeYAccum0 += bwSlopeY0;
-					bwSlopeYAccum1 += bwSlopeY1;
-					bzSlopeYAccum0 += bzSlopeY0;
-					bzSlopeYAccum1 += bzSlopeY1;
-					buSlopeYAccum0 += buSlopeY0;
-					buSlopeYAccum1 += buSlopeY1;
-					bvSlopeYAccum0 += bvSlopeY0;
-					bvSlopeYAccum1 += bvSlopeY1;
-					CY1 += FDX12;
-					CY2 += FDX23;
-					CY3 += FDX31;
-					col += width;
+	const unsigned int y0 = ((unsigned int)b0 << P::Q) + iy * ((unsigned int)b1 - (unsigned int)b0);
+	const unsigned int y1 = ((unsigned int)b2 << P::Q) + iy * ((unsigned int)b3 - (unsigned int)b2);
+	const unsigned int x0 = (y0 << P::Q) + ix * (y1 - y0);
+	return (int)x0 >> (P::Q*2);
+}
+
+/* Depth-only rasterization of one tile for deferred texturing. Every pixel
+   that passes writes the depth buffer and 'id' into the tile-local id buffer.
+   Returns the number of pixels that passed when counting samples. */
+template<class P, class D>
+static unsigned int RasterizeTileIds(const BlitContext& ctx, const Tile& t, bool edgeTest, bool zTest,
+                                     int x, int y, int id, int* ids)
+{
+	typename D::Type* depthbuffer = static_cast<typename D::Type*>(ctx.depthbuffer);
+	unsigned int passed = 0;
+	DepthStepper<P, D> zs;
+	zs.Begin(ctx, t);
+	int CY1 = t.CY1;
+	int CY2 = t.CY2;
+	int CY3 = t.CY3;
+	int col = y*ctx.width;
+	for(int iy = 0; iy < P::q; ++iy) {
+		zs.BeginRow();
+		int fbIndex = x + col;
+		int* idRow = &ids[iy << P::Q];
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i allSet = _mm_cmpeq_epi32(zero, zero);
+		const __m128i idv = _mm_set1_epi32(id);
+		__m128i cx1 = Ramp4(CY1, -t.FDY12);
+		__m128i cx2 = Ramp4(CY2, -t.FDY23);
+		__m128i cx3 = Ramp4(CY3, -t.FDY31);
+		const __m128i cx1Step = Step4(-t.FDY12);
+		const __m128i cx2Step = Step4(-t.FDY23);
+		const __m128i cx3Step = Step4(-t.FDY31);
+		for(int ix = 0; ix < P::q; ix += 4, fbIndex += 4) {
+			__m128i z, zbuf;
+			__m128i pass = zs.Test4(&depthbuffer[fbIndex], z, zbuf);
+			if(!zTest)
+				pass = allSet;
+			if(edgeTest) {
+				pass = _mm_and_si128(pass, _mm_cmpgt_epi32(cx1, zero));
+				pass = _mm_and_si128(pass, _mm_cmpgt_epi32(cx2, zero));
+				pass = _mm_and_si128(pass, _mm_cmpgt_epi32(cx3, zero));
+			}
+			if(const int mask = _mm_movemask_ps(_mm_castsi128_ps(pass))) {
+				if(ctx.depthWrite)
+					zs.Store4(&depthbuffer[fbIndex], Select4(pass, z, zbuf));
+				if(ctx.countSamples)
+					passed += BitCount4(mask);
+				__m128i idOld = _mm_loadu_si128((const __m128i*)&idRow[ix]);
+				_mm_storeu_si128((__m128i*)&idRow[ix], Select4(pass, idv, idOld));
+			}
+			cx1 = _mm_add_epi32(cx1, cx1Step);
+			cx2 = _mm_add_epi32(cx2, cx2Step);
+			cx3 = _mm_add_epi32(cx3, cx3Step);
+			zs.Next4();
+		}
+#else
+		int CX1 = CY1;
+		int CX2 = CY2;
+		int CX3 = CY3;
+		for(int ix = 0; ix < P::q; ++ix) {
+			if(!edgeTest || (CX1 > 0 && CX2 > 0 && CX3 > 0)) {
+				const typename D::Type z = zs.Get();
+				if(!zTest || zs.Passes(z, depthbuffer[fbIndex])) {
+					if(ctx.depthWrite)
+						depthbuffer[fbIndex] = z;
+					idRow[ix] = id;
+					++passed;
+				}
+			}
+			++fbIndex;
+			zs.Next();
+			CX1 -= t.FDY12;
+			CX2 -= t.FDY23;
+			CX3 -= t.FDY31;
+		}
+#endif
+		zs.NextRow();
+		CY1 += t.FDX12;
+		CY2 += t.FDX23;
+		CY3 += t.FDX31;
+		col += ctx.width;
+	}
+	return passed;
+}
+
+/* Tile-based deferred texturing. First resolves visibility for the whole bin of
+   the screen tile with a depth-only pass, remembering which tile wrote each pixel.
+   Then every visible pixel is shaded once, no matter how many tiles covered it.
+   Gives the same image as BlitTileFilled followed by BlitTilePartial, and
+   returns the same number of passed pixels. */
+template<class P, unsigned int F, class D>
+static unsigned int BlitTileDeferred(const BlitContext& ctx, WorkerScratch& scratch, TileSet& filled, TileSet& partial,
+                             int x, int y, int& zMin0, int& zMax0)
+{
+	const int V = Varyings<F>::count;
+	scratch.ids.assign(P::q * P::q, -1);
+	scratch.tiles.clear();
+	int* ids = &scratch.ids[0];
+	unsigned int passed = 0;
+
+	for(TileSet::Iterator it = filled.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		bool skipZTest = false;
+		if(!FilledTileVisible<P>(ctx, ref, zMin0, zMax0, skipZTest))
+			continue;
+		scratch.tiles.push_back(Tile());
+		Tile& t = scratch.tiles.back();
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		passed += RasterizeTileIds<P, D>(ctx, t, false, !skipZTest, x, y, scratch.tiles.size() - 1, ids);
+	}
+	for(TileSet::Iterator it = partial.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		if(!PartialTileVisible<P>(ctx, ref, zMin0, zMax0))
+			continue;
+		scratch.tiles.push_back(Tile());
+		Tile& t = scratch.tiles.back();
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		passed += RasterizeTileIds<P, D>(ctx, t, true, true, x, y, scratch.tiles.size() - 1, ids);
+	}
+	if(scratch.tiles.empty())
+		return 0;
+
+	//Shade the visible pixels
+	const Tile* tiles = &scratch.tiles[0];
+	int col = y*ctx.width;
+	for(int iy = 0; iy < P::q; ++iy) {
+		unsigned int* colorRow = &ctx.colorbuffer[x + col];
+		const int* idRow = &ids[iy << P::Q];
+		for(int ix = 0; ix < P::q; ++ix) {
+			if(idRow[ix] < 0)
+				continue;
+			const Tile& t = tiles[idRow[ix]];
+			int aw[maxVaryings];
+			for(int k = 0; k < V; ++k)
+				aw[k] = TileLerp<P>(t.ba[k][0], t.ba[k][1], t.ba[k][2], t.ba[k][3], ix, iy);
+			int w = TileLerp<P>(t.bw0, t.bw1, t.bw2, t.bw3, ix, iy);
+			colorRow[ix] = ShadePixel<P, F>(ctx, w, aw);
+		}
+		col += ctx.width;
+	}
+	return passed;
+}
+
+/* Edge function offsets of the multisample positions from the pixel, for tile t.
+   FDX and FDY step a whole pixel, which is 16 units of 28.4 */
+static inline void SampleEdgeOffsets(const Tile& t, int offsets[3][msaaSamples])
+{
+	for(int s = 0; s < msaaSamples; ++s) {
+		offsets[0][s] = (t.FDX12 * msaaSampleY[s] - t.FDY12 * msaaSampleX[s]) >> 4;
+		offsets[1][s] = (t.FDX23 * msaaSampleY[s] - t.FDY23 * msaaSampleX[s]) >> 4;
+		offsets[2][s] = (t.FDX31 * msaaSampleY[s] - t.FDY31 * msaaSampleX[s]) >> 4;
+	}
+}
+
+#ifdef __SSE2__
+/* One row of a multisampled tile, 4 pixels at a time. Every sample gets its own
+   coverage and z-test mask, and the pixels are shaded once for all of them.
+   colorSamples and depthSamples point at the row in the first sample plane.
+   Returns the number of samples that passed when counting them. */
+template<class P, unsigned int F, class D>
+static inline int BlitRowSamples4(const BlitContext& ctx, unsigned int* colorSamples, typename D::Type* depthSamples,
+                                  bool edgeTest, bool zTest, int CX1, int CX2, int CX3,
+                                  const int offsets[3][msaaSamples], const Tile& t, DepthStepper<P, D> zs,
+                                  int bw, const int* ba, int bwSlope, const int* baSlope)
+{
+	const int V = Varyings<F>::count;
+	const int n = P::q * P::q;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i allSet = _mm_cmpeq_epi32(zero, zero);
+
+	__m128i cx1 = Ramp4(CX1, -t.FDY12);
+	__m128i cx2 = Ramp4(CX2, -t.FDY23);
+	__m128i cx3 = Ramp4(CX3, -t.FDY31);
+	__m128i wAccum = Ramp4(bw, bwSlope);
+	__m128i aAccum[maxVaryings];
+	__m128i aStep[maxVaryings];
+	const __m128i cx1Step = Step4(-t.FDY12);
+	const __m128i cx2Step = Step4(-t.FDY23);
+	const __m128i cx3Step = Step4(-t.FDY31);
+	const __m128i wStep = Step4(bwSlope);
+	for(int k = 0; k < V; ++k) {
+		aAccum[k] = Ramp4(ba[k], baSlope[k]);
+		aStep[k] = Step4(baSlope[k]);
+	}
+
+	int passed = 0;
+	for(int ix = 0; ix < P::q; ix += 4) {
+		__m128i z;
+		__m128i zbuf[msaaSamples];
+		__m128i pass[msaaSamples];
+		__m128i any = zero;
+		for(int s = 0; s < msaaSamples; ++s) {
+			pass[s] = zs.Test4(&depthSamples[s*n + ix], z, zbuf[s]);
+			if(!zTest)
+				pass[s] = allSet;
+			if(edgeTest) {
+				pass[s] = _mm_and_si128(pass[s], _mm_cmpgt_epi32(_mm_add_epi32(cx1, _mm_set1_epi32(offsets[0][s])), zero));
+				pass[s] = _mm_and_si128(pass[s], _mm_cmpgt_epi32(_mm_add_epi32(cx2, _mm_set1_epi32(offsets[1][s])), zero));
+				pass[s] = _mm_and_si128(pass[s], _mm_cmpgt_epi32(_mm_add_epi32(cx3, _mm_set1_epi32(offsets[2][s])), zero));
+			}
+			any = _mm_or_si128(any, pass[s]);
+		}
+		if(_mm_movemask_ps(_mm_castsi128_ps(any))) {
+			__m128i color = zero;
+			if(!(F & SR_DEPTH_ONLY))
+				color = Shade4<P, F>(ctx, wAccum, aAccum);
+			for(int s = 0; s < msaaSamples; ++s) {
+				const int mask = _mm_movemask_ps(_mm_castsi128_ps(pass[s]));
+				if(!mask)
+					continue;
+				if(ctx.depthWrite)
+					zs.Store4(&depthSamples[s*n + ix], Select4(pass[s], z, zbuf[s]));
+				if(ctx.countSamples)
+					passed += BitCount4(mask);
+				if(!(F & SR_DEPTH_ONLY)) {
+					__m128i cold = _mm_loadu_si128((const __m128i*)&colorSamples[s*n + ix]);
+					_mm_storeu_si128((__m128i*)&colorSamples[s*n + ix], Select4(pass[s], color, cold));
+				}
+			}
+		}
+		cx1 = _mm_add_epi32(cx1, cx1Step);
+		cx2 = _mm_add_epi32(cx2, cx2Step);
+		cx3 = _mm_add_epi32(cx3, cx3Step);
+		wAccum = _mm_add_epi32(wAccum, wStep);
+		zs.Next4();
+		for(int k = 0; k < V; ++k)
+			aAccum[k] = _mm_add_epi32(aAccum[k], aStep[k]);
+	}
+	return passed;
+}
+#endif
+
+/* Blits tile t into the samples of its screen tile. Coverage is tested at every
+   sample, the pixel is shaded once and its depth is tested against every sample.
+   Without edgeTest all samples are covered, without zTest all of them pass.
+   Returns the number of samples that passed when counting them. */
+template<class P, unsigned int F, class D>
+static unsigned int BlitTileSamples(const BlitContext& ctx, WorkerScratch& scratch, const Tile& t, bool edgeTest, bool zTest)
+{
+	const int V = Varyings<F>::count;
+	unsigned int* colorSamples = &scratch.sampleColors[0];
+	typename D::Type* depthSamples = &scratch.sampleDepths.Get<D>()[0];
+#ifndef __SSE2__
+	const int n = P::q * P::q;
+#endif
+	int offsets[3][msaaSamples];
+	SampleEdgeOffsets(t, offsets);
+	unsigned int passed = 0;
+	DepthStepper<P, D> zs;
+	zs.Begin(ctx, t);
+	//Gradients for y interpolation
+	const int bwSlopeY0 = t.bw1 - t.bw0;
+	const int bwSlopeY1 = t.bw3 - t.bw2;
+	int baSlopeY0[maxVaryings];
+	int baSlopeY1[maxVaryings];
+	//Accumulators (actual interpolated value) for y
+	int bwSlopeYAccum0 = t.bw0 << P::Q;
+	int bwSlopeYAccum1 = t.bw2 << P::Q;
+	int baSlopeYAccum0[maxVaryings];
+	int baSlopeYAccum1[maxVaryings];
+	for(int k = 0; k < V; ++k) {
+		baSlopeY0[k] = t.ba[k][1] - t.ba[k][0];
+		baSlopeY1[k] = t.ba[k][3] - t.ba[k][2];
+		baSlopeYAccum0[k] = t.ba[k][0] << P::Q;
+		baSlopeYAccum1[k] = t.ba[k][2] << P::Q;
+	}
+	int CY1 = t.CY1;
+	int CY2 = t.CY2;
+	int CY3 = t.CY3;
+	for(int iy = 0; iy < P::q; ++iy) {
+		int CX1 = CY1;
+		int CX2 = CY2;
+		int CX3 = CY3;
+		//Gradients for x interpolation
+		const int bwSlopeX0 = bwSlopeYAccum1 - bwSlopeYAccum0;
+		int baSlopeX0[maxVaryings];
+		//Accumulators (actual interpolated value) for x
+		int bwSlopeXAccum0 = bwSlopeYAccum0 << P::Q;
+		zs.BeginRow();
+		int baSlopeXAccum0[maxVaryings];
+		for(int k = 0; k < V; ++k) {
+			baSlopeX0[k] = baSlopeYAccum1[k] - baSlopeYAccum0[k];
+			baSlopeXAccum0[k] = baSlopeYAccum0[k] << P::Q;
+		}
+		int index = iy << P::Q;
+#ifdef __SSE2__
+		passed += BlitRowSamples4<P, F, D>(ctx, &colorSamples[index], &depthSamples[index], edgeTest, zTest,
+		                                   CX1, CX2, CX3, offsets, t, zs,
+		                                   bwSlopeXAccum0, baSlopeXAccum0, bwSlopeX0, baSlopeX0);
+#else
+		for(int ix = 0; ix < P::q; ++ix) {
+			const typename D::Type z = zs.Get();
+			int mask = 0;
+			for(int s = 0; s < msaaSamples; ++s) {
+				if(edgeTest && !(CX1 + offsets[0][s] > 0 && CX2 + offsets[1][s] > 0 && CX3 + offsets[2][s] > 0))
+					continue;
+				if(!zTest || zs.Passes(z, depthSamples[s*n + index]))
+					mask |= 1 << s;
+			}
+			if(mask) {
+				unsigned int color = 0;
+				if(!(F & SR_DEPTH_ONLY)) {
+					int aw[maxVaryings];
+					for(int k = 0; k < V; ++k)
+						aw[k] = baSlopeXAccum0[k] >> (P::Q*2);
+					color = ShadePixel<P, F>(ctx, bwSlopeXAccum0 >> (P::Q*2), aw);
+				}
+				for(int s = 0; s < msaaSamples; ++s) {
+					if(!(mask & (1 << s)))
+						continue;
+					if(ctx.depthWrite)
+						depthSamples[s*n + index] = z;
+					if(!(F & SR_DEPTH_ONLY))
+						colorSamples[s*n + index] = color;
+					++passed;
+				}
+			}
+			++index;
+			bwSlopeXAccum0 += bwSlopeX0;
+			zs.Next();
+			for(int k = 0; k < V; ++k)
+				baSlopeXAccum0[k] += baSlopeX0[k];
+			CX1 -= t.FDY12;
+			CX2 -= t.FDY23;
+			CX3 -= t.FDY31;
+		}
+#endif
+		bwSlopeYAccum0 += bwSlopeY0;
+		bwSlopeYAccum1 += bwSlopeY1;
+		zs.NextRow();
+		for(int k = 0; k < V; ++k) {
+			baSlopeYAccum0[k] += baSlopeY0[k];
+			baSlopeYAccum1[k] += baSlopeY1[k];
+		}
+		CY1 += t.FDX12;
+		CY2 += t.FDX23;
+		CY3 += t.FDX31;
+	}
+	return passed;
+}
+
+/* Loads the samples of the screen tile at pixel (x, y). Color samples are set to
+   their pixel. The depth samples of a pixel are the kept ones as long as their
+   nearest is what the depth buffer holds. When it isn't, the pixel was cleared
+   or drawn without multisampling since, and every sample gets its depth */
+template<class P, unsigned int F, class D>
+static void LoadTileSamples(const BlitContext& ctx, WorkerScratch& scratch, int x, int y)
+{
+	typedef typename D::Type Type;
+	const int n = P::q * P::q;
+	const Type* depthbuffer = static_cast<const Type*>(ctx.depthbuffer);
+	const Type* planes = static_cast<const Type*>(ctx.depthSamples);
+	Type* depthSamples = &scratch.sampleDepths.Get<D>()[0];
+	unsigned int* colorSamples = &scratch.sampleColors[0];
+	int col = y*ctx.width;
+	for(int iy = 0; iy < P::q; ++iy) {
+		const int index = iy << P::Q;
+		for(int ix = 0; ix < P::q; ++ix) {
+			const int i = x + col + ix;
+			Type z = planes[i];
+			for(int s = 1; s < msaaSamples; ++s) {
+				if(D::Passes(planes[s*ctx.samplePlane + i], z))
+					z = planes[s*ctx.samplePlane + i];
+			}
+			const bool kept = z == depthbuffer[i];
+			for(int s = 0; s < msaaSamples; ++s)
+				depthSamples[s*n + index + ix] = kept ? planes[s*ctx.samplePlane + i] : depthbuffer[i];
+		}
+		if(!(F & SR_DEPTH_ONLY)) {
+			for(int s = 0; s < msaaSamples; ++s)
+				std::copy(&ctx.colorbuffer[x + col], &ctx.colorbuffer[x + col + P::q], &colorSamples[s*n + index]);
+		}
+		col += ctx.width;
+	}
+}
+
+/* Average of a and b per channel, rounded up like _mm_avg_epu8 */
+static inline unsigned int AverageColor(unsigned int a, unsigned int b)
+{
+	return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+/* Writes the samples of the screen tile at pixel (x, y) back. Color is the
+   average of the samples, and depth the nearest one. The depth samples
+   themselves are kept for the next draw */
+template<class P, unsigned int F, class D>
+static void ResolveTileSamples(const BlitContext& ctx, WorkerScratch& scratch, int x, int y)
+{
+	typedef typename D::Type Type;
+	const int n = P::q * P::q;
+	Type* depthbuffer = static_cast<Type*>(ctx.depthbuffer);
+	Type* planes = static_cast<Type*>(ctx.depthSamples);
+	const Type* depthSamples = &scratch.sampleDepths.Get<D>()[0];
+	const unsigned int* colorSamples = &scratch.sampleColors[0];
+	int col = y*ctx.width;
+	for(int iy = 0; iy < P::q; ++iy) {
+		const int index = iy << P::Q;
+		if(!(F & SR_DEPTH_ONLY)) {
+			unsigned int* colorRow = &ctx.colorbuffer[x + col];
+			const unsigned int* c = &colorSamples[index];
+#ifdef __SSE2__
+			for(int ix = 0; ix < P::q; ix += 4) {
+				const __m128i c0 = _mm_loadu_si128((const __m128i*)&c[ix]);
+				const __m128i c1 = _mm_loadu_si128((const __m128i*)&c[n + ix]);
+				const __m128i c2 = _mm_loadu_si128((const __m128i*)&c[2*n + ix]);
+				const __m128i c3 = _mm_loadu_si128((const __m128i*)&c[3*n + ix]);
+				_mm_storeu_si128((__m128i*)&colorRow[ix], _mm_avg_epu8(_mm_avg_epu8(c0, c1), _mm_avg_epu8(c2, c3)));
+			}
+#else
+			for(int ix = 0; ix < P::q; ++ix)
+				colorRow[ix] = AverageColor(AverageColor(c[ix], c[n + ix]), AverageColor(c[2*n + ix], c[3*n + ix]));
+#endif
+		}
+		//Untouched otherwise
+		if(ctx.depthWrite) {
+			Type* depthRow = &depthbuffer[x + col];
+			const Type* d = &depthSamples[index];
+			for(int ix = 0; ix < P::q; ++ix) {
+				Type z = d[ix];
+				for(int s = 1; s < msaaSamples; ++s) {
+					if(D::Passes(d[s*n + ix], z))
+						z = d[s*n + ix];
 				}
+				depthRow[ix] = z;
 			}
+			for(int s = 0; s < msaaSamples; ++s)
+				std::copy(&d[s*n], &d[s*n + P::q], &planes[s*ctx.samplePlane + x + col]);
+		}
+		col += ctx.width;
+	}
+}
+
+/* 4x multisampled blitting of a screen tile. The samples only live in the scratch
+   of the worker while the bin is drawn, and are resolved into the color and depth
+   buffer when it is done. The binner tests the tiles at the samples, so a filled
+   tile covers every sample. Returns the number of samples that passed. */
+template<class P, unsigned int F, class D>
+static unsigned int BlitTileMultisampled(const BlitContext& ctx, WorkerScratch& scratch, TileSet& filled, TileSet& partial,
+                                         int x, int y, int& zMin0, int& zMax0)
+{
+	const int n = P::q * P::q;
+	if(scratch.sampleColors.size() < msaaSamples * n)
+		scratch.sampleColors.resize(msaaSamples * n);
+	if(scratch.sampleDepths.Get<D>().size() < msaaSamples * n)
+		scratch.sampleDepths.Get<D>().resize(msaaSamples * n);
+	//Only loaded once something is visible
+	bool loaded = false;
+	unsigned int passed = 0;
+
+	for(TileSet::Iterator it = filled.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		bool skipZTest = false;
+		if(!FilledTileVisible<P>(ctx, ref, zMin0, zMax0, skipZTest))
+			continue;
+		if(!loaded) {
+			LoadTileSamples<P, F, D>(ctx, scratch, x, y);
+			loaded = true;
+		}
+		Tile t;
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		passed += BlitTileSamples<P, F, D>(ctx, scratch, t, false, !skipZTest);
+	}
+	for(TileSet::Iterator it = partial.Begin(); it.Valid(); it.Next()) {
+		const TileRef& ref = it.Get();
+		if(!PartialTileVisible<P>(ctx, ref, zMin0, zMax0))
+			continue;
+		if(!loaded) {
+			LoadTileSamples<P, F, D>(ctx, scratch, x, y);
+			loaded = true;
 		}
+		Tile t;
+		SetupTileRef<P, F, D>(ctx, ref, x, y, t);
+		passed += BlitTileSamples<P, F, D>(ctx, scratch, t, true, true);
+	}
+	if(loaded)
+		ResolveTileSamples<P, F, D>(ctx, scratch, x, y);
+	return passed;
+}
+
+//Bins with at least this many tiles get sorted front to back before blitting.
+//With fewer, there is too little overdraw for the sort to pay off.
+//Only when depth is written: then the nearest fragment wins whatever the
+//order, and only fragments of equal depth can come out differently. Without
+//depth writes the last fragment drawn wins, so the order has to be kept.
+const int sortMinTiles = 8;
+
+
+/* Stable counting sort of a bin on zMin, quantized to 256 steps over the depth
+   range of the bin. Drawn front to back, most hidden tiles are rejected by the
+   coarse depth buffer, and most hidden pixels fail the z-test before texturing. */
+template<class P>
+static void SortBin(TileSet& bin, std::vector<TileRef>& scratch)
+{
+	int counts[257] = {0};
+	const int n = bin.count;
+	scratch.resize(n * 2);
+	TileRef* refs = &scratch[0];
+	TileRef* sorted = &scratch[n];
+
+	//Out of range depths are clamped, they can't be rejected early anyway
+	int zLo = P::depth_max;
+	int zHi = 0;
+	int i = 0;
+	for(TileSet::Iterator it = bin.Begin(); it.Valid(); it.Next(), ++i) {
+		refs[i] = it.Get();
+		const int z = clamp(refs[i].zMin, 0, (int)P::depth_max);
+		zLo = std::min(zLo, z);
+		zHi = std::max(zHi, z);
+	}
+	if(zLo == zHi)
+		return;
+
+	const int range = zHi - zLo + 1;
+	for(i = 0; i < n; ++i) {
+		const int key = (clamp(refs[i].zMin, 0, (int)P::depth_max) - zLo) * 256 / range;
+		++counts[key + 1];
+	}
+	for(i = 1; i < 257; ++i)
+		counts[i] += counts[i - 1];
+	for(i = 0; i < n; ++i) {
+		const int key = (clamp(refs[i].zMin, 0, (int)P::depth_max) - zLo) * 256 / range;
+		sorted[counts[key]++] = refs[i];
+	}
+
+	i = 0;
+	for(TileSet::Iterator it = bin.Begin(); it.Valid(); it.Next(), ++i)
+		it.Get() = sorted[i];
+}
+
+/* Each screen tile only touches its own rectangle of the color- and depth buffer,
+   so tiles are independent work items. The filled tiles are drawn before the
+   partial ones, like when the two passes ran over the whole screen. */
+template<class P, unsigned int F, class D>
+static void BlitTileJob(int tileIdx, int worker, void* data)
+{
+	const BlitContext& ctx = *static_cast<const BlitContext*>(data);
+	const int x = (tileIdx % ctx.numTilesX) << P::Q;
+	const int y = (tileIdx / ctx.numTilesX) << P::Q;
+	int& zMin = TileBins<P>::hizMin[tileIdx];
+	int& zMax = TileBins<P>::hizMax[tileIdx];
+	TileSet& filled = TileBins<P>::tileListFilled[tileIdx];
+	TileSet& partial = TileBins<P>::tileList[tileIdx];
+	WorkerScratch& scratch = wc_workerScratch[worker];
+	//Pending clears of the tile go first. It covers whole clear blocks, which no other job touches
+	SR_ResolveClearRect(ctx.colorbuffer, x, y, P::q, P::q);
+	if(ctx.depthWrite && filled.count >= sortMinTiles)
+		SortBin<P>(filled, scratch.sort);
+	if(ctx.depthWrite && partial.count >= sortMinTiles)
+		SortBin<P>(partial, scratch.sort);
+	//Nothing to shade with SR_DEPTH_ONLY, so nothing to defer.
+	//Multisampling shades once per pixel anyway, and goes first.
+	unsigned int passed;
+	if(ctx.multisampling) {
+		passed = BlitTileMultisampled<P, F, D>(ctx, scratch, filled, partial, x, y, zMin, zMax);
+	} else if(ctx.deferredTexturing && !(F & SR_DEPTH_ONLY)) {
+		passed = BlitTileDeferred<P, F, D>(ctx, scratch, filled, partial, x, y, zMin, zMax);
+	} else {
+		passed = BlitTileFilled<P, F, D>(ctx, filled, x, y, zMin, zMax);
+		passed += BlitTilePartial<P, F, D>(ctx, partial, x, y, zMin, zMax);
 	}
-	wc_colorbuffer->Unlock();
+	//Per worker, reduced by BlitTiles once all jobs are done
+	if(ctx.countSamples)
+		scratch.samplesPassed += passed;
 }
 
-void DrawTrianglesDeferred(unsigned int flags)
+static std::vector<int> wc_blitItems; //non-empty screen tiles
+static std::vector<int> wc_blitCosts; //number of binned tiles in each
+
+/* Texture state of the blitters for tex, which has to be bound when used */
+template<class P>
+static void SetupBlitTexture(const Texture* tex, BlitTexture& bt)
+{
+	bt.tbuf = 0;
+	bt.iTw = bt.iTh = 1;
+	if(tex) {
+		bt.tbuf = &tex->texels[0];
+		bt.iTw = tex->width;
+		bt.iTh = tex->height;
+	}
+	bt.uScale = (double)(bt.iTw - 1) / (double)(1 << (P::coeff_precision_base * 2));
+	bt.vScale = (double)(bt.iTh - 1) / (double)(1 << (P::coeff_precision_base * 2));
+}
+
+/* The bound depth buffer of format D */
+template<class D>
+static typename D::Type* BoundDepthBuffer();
+
+template<>
+unsigned short* BoundDepthBuffer<Depth16>() { return wc_depthbuffer->Ptr(); }
+template<>
+unsigned int* BoundDepthBuffer<DepthFixed>() { return wc_depthbuffer32->Ptr(); }
+template<>
+float* BoundDepthBuffer<DepthFloat>() { return wc_depthbufferf->Ptr(); }
+
+template<class P, unsigned int F, class D>
+static void BlitTiles()
+{
+	BlitContext ctx;
+	ctx.width = wc_colorbuffer->w;
+	ctx.numTilesX = (wc_colorbuffer->w >> P::Q);
+	const unsigned int numTiles = ctx.numTilesX * (wc_colorbuffer->h >> P::Q);
+	SetupBlitTexture<P>((F & SR_TEXCOORD0) ? wc_texture0 : 0, ctx.tex0);
+	SetupBlitTexture<P>((F & SR_TEXCOORD1) ? wc_texture1 : 0, ctx.tex1);
+	ctx.colorScale = 255.0 / (double)(1 << (P::coeff_precision_base * 2));
+	ctx.lightX = wc_lightX;
+	ctx.lightY = wc_lightY;
+	ctx.lightZ = wc_lightZ;
+	ctx.ambient = wc_ambient;
+	ctx.diffuse = 1.0f - wc_ambient;
+	ctx.triangles = wc_triangles.empty() ? 0 : &wc_triangles[0];
+	ctx.varyingCoeffs = wc_varyingCoeffs.empty() ? 0 : &wc_varyingCoeffs[0];
+	ctx.NDC_x_step = 2.0f / (float)ctx.width * (float)P::i_ndc_precision;
+	ctx.NDC_y_step = 2.0f / (float)wc_colorbuffer->h * (float)P::i_ndc_precision;
+	//[0, 1] maps to [0, 2^bits> like the 16-bit format, but the float one is stored as is
+	ctx.depthScale = 1.0;
+	if(wc_depthFormat == SR_DEPTH_24)
+		ctx.depthScale = 16777216.0;
+	else if(wc_depthFormat == SR_DEPTH_32)
+		ctx.depthScale = 4294967296.0;
+	ctx.depthMax = wc_depthFormat == SR_DEPTH_FLOAT_REVERSED ? 1.0 : ctx.depthScale - 1.0;
+	ctx.depthEqual = wc_depthEqual;
+	ctx.depthWrite = wc_depthWrite;
+	ctx.countSamples = wc_queryActive;
+	ctx.deferredTexturing = wc_deferredTexturing;
+	ctx.multisampling = wc_multisampling;
+
+	wc_blitItems.clear();
+	wc_blitCosts.clear();
+	for(unsigned int i = 0; i < numTiles; ++i) {
+		//Partial tiles do the edge tests, so weigh them a bit more
+		int cost = TileBins<P>::tileListFilled[i].count + 2*TileBins<P>::tileList[i].count;
+		if(!cost) continue;
+		wc_blitItems.push_back(i);
+		wc_blitCosts.push_back(cost);
+	}
+	if(wc_blitItems.empty())
+		return;
+
+	const size_t numWorkers = SR_NumWorkers();
+	if(wc_workerScratch.size() < numWorkers)
+		wc_workerScratch.resize(numWorkers);
+	for(size_t i = 0; i < wc_workerScratch.size(); ++i)
+		wc_workerScratch[i].samplesPassed = 0;
+
+	//Lock once for all workers, SDL surfaces should only be locked from one thread
+	ctx.colorbuffer = (F & SR_DEPTH_ONLY) ? 0 : wc_colorbuffer->Lock();
+	ctx.depthbuffer = BoundDepthBuffer<D>();
+	ctx.depthSamples = 0;
+	ctx.samplePlane = ctx.width * wc_colorbuffer->h;
+	if(ctx.multisampling) {
+		//Every sample starts at the depth of its pixel
+		std::vector<typename D::Type>& planes = wc_sampleDepths.Get<D>();
+		if(planes.size() != msaaSamples * ctx.samplePlane) {
+			SR_ResolveClears(SR_DEPTH_BUFFER);
+			const typename D::Type* depth = static_cast<const typename D::Type*>(ctx.depthbuffer);
+			planes.resize(msaaSamples * ctx.samplePlane);
+			for(int s = 0; s < msaaSamples; ++s)
+				std::copy(depth, depth + ctx.samplePlane, &planes[s*ctx.samplePlane]);
+		}
+		ctx.depthSamples = &planes[0];
+	}
+	SR_RunJobs(BlitTileJob<P, F, D>, &ctx, &wc_blitItems[0], &wc_blitCosts[0], wc_blitItems.size());
+	if(!(F & SR_DEPTH_ONLY))
+		wc_colorbuffer->Unlock();
+	if(ctx.countSamples) {
+		for(size_t i = 0; i < wc_workerScratch.size(); ++i)
+			wc_querySamples += wc_workerScratch[i].samplesPassed;
+	}
+}
+
+/* Inside bits of the corners (x0, y0), (x1, y0), (x0, y1), (x1, y1) of a
+   block against one edge. Coordinates are 28.4 */
+static inline int EdgeMask(long long C, int DX, int DY, int x0, int x1, int y0, int y1)
+{
+	bool e00 = C + (long long)DX * y0 - (long long)DY * x0 > 0;
+	bool e10 = C + (long long)DX * y0 - (long long)DY * x1 > 0;
+	bool e01 = C + (long long)DX * y1 - (long long)DY * x0 > 0;
+	bool e11 = C + (long long)DX * y1 - (long long)DY * x1 > 0;
+
+	return (e00 << 0) | (e10 << 1) | (e01 << 2) | (e11 << 3);
+}
+
+/* Puts the tile at pixel (x, y) into the filled or partial bin of its screen tile,
+   unless the coarse depth buffer says it is occluded. Returns true when binned. */
+template<class P, class D>
+static bool BinTile(const TriangleSetup& tri, int triIdx, int x, int y, bool filled, bool depthWrite,
+                    unsigned int numTilesX, int NDC_x_step, int NDC_y_step)
+{
+	using std::min;
+	using std::max;
+
+	int bz0, bz1, bz2, bz3;
+	TileDepthCorners<P>(tri, x, y, NDC_x_step, NDC_y_step, bz0, bz1, bz2, bz3);
+
+	TileRef ref;
+	ref.tri = triIdx;
+	ref.zMin = min(min(min(bz0, bz1), bz2), bz3) - D::hizPad;
+	ref.zMax = max(max(max(bz0, bz1), bz2), bz3) + D::hizPad;
+	const int tileIdx = (x >> P::Q) + (y >> P::Q) * numTilesX;
+	// Early z-cull against the coarse depth buffer. Filled tiles binned earlier
+	// count as well: they get drawn this frame and nothing behind them can win.
+	// Not when the depth buffer isn't written.
+	if(TileDepthInRange<P>(ref)) {
+		if(ref.zMin > TileBins<P>::hizMax[tileIdx])
+			return false;
+		if(filled && depthWrite)
+			TileBins<P>::hizMax[tileIdx] = min(TileBins<P>::hizMax[tileIdx], ref.zMax);
+	}
+
+	// Accept whole block when totally covered
+	if(filled) {
+		TileBins<P>::tileListFilled[tileIdx].Push(ref, wc_tileArena);
+	} else {
+		TileBins<P>::tileList[tileIdx].Push(ref, wc_tileArena);
+	}
+	return true;
+}
+
+/* Appends the triangle and the coefficients of its varyings, from triangle i of
+   the post streams, to wc_triangles and wc_varyingCoeffs */
+template<class P, unsigned int F>
+static void PushTriangle(const TriangleSetup& tri, int i)
+{
+	typedef Varyings<F> VL;
+	const int V = VL::count;
+	wc_triangles.push_back(tri);
+	if(!V)
+		return;
+	const size_t first = wc_varyingCoeffs.size();
+	wc_varyingCoeffs.resize(first + 3*V);
+	int* coeffs = &wc_varyingCoeffs[first];
+	const float s = (float)P::i_coeff_precision;
+	//A, B and C come from the first, second and third vertex
+	for(int j = 0; j < 3; ++j, coeffs += V) {
+		if(F & SR_TEXCOORD0) {
+			const VectorPOD4f& tc = wc_postTcoords0.data[i+j];
+			coeffs[VL::tex0 + 0] = tc.x * s;
+			coeffs[VL::tex0 + 1] = tc.y * s;
+		}
+		if(F & SR_TEXCOORD1) {
+			const VectorPOD4f& tc = wc_postTcoords1.data[i+j];
+			coeffs[VL::tex1 + 0] = tc.x * s;
+			coeffs[VL::tex1 + 1] = tc.y * s;
+		}
+		if(F & SR_LIGHTING) {
+			const VectorPOD4f& n = wc_postNormals.data[i+j];
+			coeffs[VL::normal + 0] = n.x * s;
+			coeffs[VL::normal + 1] = n.y * s;
+			coeffs[VL::normal + 2] = n.z * s;
+		}
+		if(F & SR_COLOR) {
+			const VectorPOD4f& c = wc_postColors.data[i+j];
+			coeffs[VL::color + 0] = c.x * s;
+			coeffs[VL::color + 1] = c.y * s;
+			coeffs[VL::color + 2] = c.z * s;
+		}
+	}
+}
+
+/* Half-edge constant of the edge through the 28.4 point (X, Y) with deltas
+   DX and DY, corrected for fill convention */
+static inline long long EdgeConstant(int DX, int DY, int X, int Y)
+{
+	long long C = (long long)DY * X - (long long)DX * Y;
+	if(DY < 0 || (DY == 0 && DX > 0)) C++;
+	return C;
+}
+
+/* Setup of the triangle at vertex i: 28.4 coordinates, edge functions and
+   depth and w planes, and the blocks it touches. maxX and maxY are the size of
+   the whole tiles of the screen. Returns false when it covers no sample. */
+template<class P, class D>
+static inline bool SetupTriangle(const VectorPOD4f* vertices, int i, int samplePad, int maxX, int maxY,
+                                 TriangleSetup& tri, TriangleBounds& bounds)
+{
+	using std::min;
+	using std::max;
+
+	const VectorPOD4f& v1 = vertices[i+0];
+	const VectorPOD4f& v2 = vertices[i+2];
+	const VectorPOD4f& v3 = vertices[i+1];
+
+	// 28.4 fixed-point coordinates
+	const int Y1 = (int)(16.0f * v1.y);
+	const int Y2 = (int)(16.0f * v2.y);
+	const int Y3 = (int)(16.0f * v3.y);
+	const int X1 = (int)(16.0f * v1.x);
+	const int X2 = (int)(16.0f * v2.x);
+	const int X3 = (int)(16.0f * v3.x);
+
+	// Deltas
+	const int DX12 = tri.DX12 = X1 - X2;
+	const int DX23 = tri.DX23 = X2 - X3;
+	const int DX31 = tri.DX31 = X3 - X1;
+	const int DY12 = tri.DY12 = Y1 - Y2;
+	const int DY23 = tri.DY23 = Y2 - Y3;
+	const int DY31 = tri.DY31 = Y3 - Y1;
+
+	// Bounding rectangle
+	int minx = (min(X1, min(X2, X3)) - samplePad + 0xF) >> 4;
+	int maxx = (max(X1, max(X2, X3)) + samplePad + 0xF) >> 4;
+	int miny = (min(Y1, min(Y2, Y3)) - samplePad + 0xF) >> 4;
+	int maxy = (max(Y1, max(Y2, Y3)) + samplePad + 0xF) >> 4;
+
+	// Micro triangles that cover no pixel sample at all
+	if(minx == maxx || miny == maxy)
+		return false;
+
+	// A triangle can only cover a whole tile when it spans at least a tile
+	bounds.smallerThanTile = (maxx - minx) < P::q || (maxy - miny) < P::q;
+
+	// Start in corner of a 8x8 block alligned to block size
+	minx &= ~(P::q - 1);
+	miny &= ~(P::q - 1);
+	maxx = (maxx + (P::q - 1)) & ~(P::q - 1);
+	maxy = (maxy + (P::q - 1)) & ~(P::q - 1);
+
+	// Clip to the screen. Only whole blocks get drawn
+	bounds.minx = max(minx, 0);
+	bounds.miny = max(miny, 0);
+	bounds.maxx = min(maxx, maxX);
+	bounds.maxy = min(maxy, maxY);
+	bounds.first = i;
+	if(bounds.minx >= bounds.maxx || bounds.miny >= bounds.maxy)
+		return false;
+
+	tri.C1 = EdgeConstant(DX12, DY12, X1, Y1);
+	tri.C2 = EdgeConstant(DX23, DY23, X2, Y2);
+	tri.C3 = EdgeConstant(DX31, DY31, X3, Y3);
+
+	if(D::reversed) {
+		//Flipped back for the coarse depth buffer, which is the same for all formats
+		tri.Az = -v1.z * (float)P::i_depth_precision;
+		tri.Bz = -v3.z * (float)P::i_depth_precision;
+		tri.Cz = (1.0f - v2.z) * (float)P::i_depth_precision;
+	} else {
+		tri.Az = v1.z * (float)P::i_depth_precision;
+		tri.Bz = v3.z * (float)P::i_depth_precision;
+		tri.Cz = v2.z * (float)P::i_depth_precision;
+	}
+	tri.zA = v1.z;
+	tri.zB = v3.z;
+	tri.zC = v2.z;
+	tri.Aw = v1.w  * (float)P::i_coeff_precision;
+	tri.Bw = v3.w  * (float)P::i_coeff_precision;
+	tri.Cw = v2.w  * (float)P::i_coeff_precision;
+	return true;
+}
+
+#ifdef __SSE2__
+/* SetupTriangle of the 4 triangles from vertex i, in SoA registers. The ones that
+   cover a sample are written to tris and bounds, compacted, and counted in the
+   return value. Same integer operations and float to int conversions as
+   SetupTriangle, so the same results. vertices is a post stream, so aligned */
+template<class P, class D>
+static inline int SetupTriangles4(const VectorPOD4f* vertices, int i, int samplePad, int maxX, int maxY,
+                                  TriangleSetup* tris, TriangleBounds* bounds)
+{
+	//x, y, z and w of the first, second and third vertex of the 4 triangles
+	__m128 vx[3], vy[3], vz[3], vw[3];
+	for(int j = 0; j < 3; ++j) {
+		__m128 r0 = _mm_load_ps(&vertices[i + j].x);
+		__m128 r1 = _mm_load_ps(&vertices[i + 3 + j].x);
+		__m128 r2 = _mm_load_ps(&vertices[i + 6 + j].x);
+		__m128 r3 = _mm_load_ps(&vertices[i + 9 + j].x);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		vx[j] = r0;
+		vy[j] = r1;
+		vz[j] = r2;
+		vw[j] = r3;
+	}
+	//v1, v2 and v3 are the first, third and second vertex
+	const int k1 = 0, k2 = 2, k3 = 1;
+	const __m128 sixteen = _mm_set1_ps(16.0f);
+	const __m128i X1 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vx[k1]));
+	const __m128i X2 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vx[k2]));
+	const __m128i X3 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vx[k3]));
+	const __m128i Y1 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vy[k1]));
+	const __m128i Y2 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vy[k2]));
+	const __m128i Y3 = _mm_cvttps_epi32(_mm_mul_ps(sixteen, vy[k3]));
+
+	const __m128i DX12 = _mm_sub_epi32(X1, X2);
+	const __m128i DX23 = _mm_sub_epi32(X2, X3);
+	const __m128i DX31 = _mm_sub_epi32(X3, X1);
+	const __m128i DY12 = _mm_sub_epi32(Y1, Y2);
+	const __m128i DY23 = _mm_sub_epi32(Y2, Y3);
+	const __m128i DY31 = _mm_sub_epi32(Y3, Y1);
+
+	const __m128i lo = _mm_set1_epi32(0xF - samplePad);
+	const __m128i hi = _mm_set1_epi32(0xF + samplePad);
+	__m128i minx = _mm_srai_epi32(_mm_add_epi32(Min4(X1, Min4(X2, X3)), lo), 4);
+	__m128i maxx = _mm_srai_epi32(_mm_add_epi32(Max4(X1, Max4(X2, X3)), hi), 4);
+	__m128i miny = _mm_srai_epi32(_mm_add_epi32(Min4(Y1, Min4(Y2, Y3)), lo), 4);
+	__m128i maxy = _mm_srai_epi32(_mm_add_epi32(Max4(Y1, Max4(Y2, Y3)), hi), 4);
+	__m128i reject = _mm_or_si128(_mm_cmpeq_epi32(minx, maxx), _mm_cmpeq_epi32(miny, maxy));
+
+	const __m128i q = _mm_set1_epi32(P::q);
+	const __m128i small = _mm_or_si128(_mm_cmplt_epi32(_mm_sub_epi32(maxx, minx), q),
+	                                   _mm_cmplt_epi32(_mm_sub_epi32(maxy, miny), q));
+
+	const __m128i align = _mm_set1_epi32(~(P::q - 1));
+	const __m128i round = _mm_set1_epi32(P::q - 1);
+	const __m128i zero = _mm_setzero_si128();
+	minx = Max4(_mm_and_si128(minx, align), zero);
+	miny = Max4(_mm_and_si128(miny, align), zero);
+	maxx = Min4(_mm_and_si128(_mm_add_epi32(maxx, round), align), _mm_set1_epi32(maxX));
+	maxy = Min4(_mm_and_si128(_mm_add_epi32(maxy, round), align), _mm_set1_epi32(maxY));
+	//Nothing left on screen: minx >= maxx or miny >= maxy
+	const __m128i onScreen = _mm_and_si128(_mm_cmpgt_epi32(maxx, minx), _mm_cmpgt_epi32(maxy, miny));
+	reject = _mm_or_si128(reject, _mm_andnot_si128(onScreen, _mm_cmpeq_epi32(zero, zero)));
+	const int keep = ~_mm_movemask_ps(_mm_castsi128_ps(reject)) & 0xF;
+	if(!keep)
+		return 0;
+
+	const __m128 zScale = _mm_set1_ps((float)P::i_depth_precision);
+	const __m128 wScale = _mm_set1_ps((float)P::i_coeff_precision);
+	__m128i Az, Bz, Cz;
+	if(D::reversed) {
+		const __m128 sign = _mm_set1_ps(-0.0f);
+		Az = _mm_cvttps_epi32(_mm_mul_ps(_mm_xor_ps(vz[k1], sign), zScale));
+		Bz = _mm_cvttps_epi32(_mm_mul_ps(_mm_xor_ps(vz[k3], sign), zScale));
+		Cz = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.0f), vz[k2]), zScale));
+	} else {
+		Az = _mm_cvttps_epi32(_mm_mul_ps(vz[k1], zScale));
+		Bz = _mm_cvttps_epi32(_mm_mul_ps(vz[k3], zScale));
+		Cz = _mm_cvttps_epi32(_mm_mul_ps(vz[k2], zScale));
+	}
+	const __m128i Aw = _mm_cvttps_epi32(_mm_mul_ps(vw[k1], wScale));
+	const __m128i Bw = _mm_cvttps_epi32(_mm_mul_ps(vw[k3], wScale));
+	const __m128i Cw = _mm_cvttps_epi32(_mm_mul_ps(vw[k2], wScale));
+
+	//Out of SoA, for the survivors only
+	int lanes[22][4];
+	const __m128i fields[22] = {DX12, DX23, DX31, DY12, DY23, DY31, X1, X2, X3, Y1, Y2, Y3, Az, Bz, Cz,
+	                            Aw, Bw, Cw, minx, miny, maxx, maxy};
+	for(int f = 0; f < 22; ++f)
+		_mm_storeu_si128((__m128i*)lanes[f], fields[f]);
+	float z[3][4];
+	_mm_storeu_ps(z[0], vz[k1]);
+	_mm_storeu_ps(z[1], vz[k3]);
+	_mm_storeu_ps(z[2], vz[k2]);
+	const int smallMask = _mm_movemask_ps(_mm_castsi128_ps(small));
+
+	int n = 0;
+	for(int l = 0; l < 4; ++l) {
+		if(!(keep & (1 << l)))
+			continue;
+		TriangleSetup& tri = tris[n];
+		TriangleBounds& b = bounds[n];
+		tri.DX12 = lanes[0][l];
+		tri.DX23 = lanes[1][l];
+		tri.DX31 = lanes[2][l];
+		tri.DY12 = lanes[3][l];
+		tri.DY23 = lanes[4][l];
+		tri.DY31 = lanes[5][l];
+		//64-bit, which SSE2 can't multiply
+		tri.C1 = EdgeConstant(tri.DX12, tri.DY12, lanes[6][l], lanes[9][l]);
+		tri.C2 = EdgeConstant(tri.DX23, tri.DY23, lanes[7][l], lanes[10][l]);
+		tri.C3 = EdgeConstant(tri.DX31, tri.DY31, lanes[8][l], lanes[11][l]);
+		tri.Az = lanes[12][l];
+		tri.Bz = lanes[13][l];
+		tri.Cz = lanes[14][l];
+		tri.Aw = lanes[15][l];
+		tri.Bw = lanes[16][l];
+		tri.Cw = lanes[17][l];
+		tri.zA = z[0][l];
+		tri.zB = z[1][l];
+		tri.zC = z[2][l];
+		b.minx = lanes[18][l];
+		b.miny = lanes[19][l];
+		b.maxx = lanes[20][l];
+		b.maxy = lanes[21][l];
+		b.smallerThanTile = (smallMask >> l) & 1;
+		b.first = i + 3*l;
+		++n;
+	}
+	return n;
+}
+#endif
+
+/* Sets up the triangles of the count vertices, 4 at a time with SSE2. The ones
+   that can cover a sample end up at the front of wc_setupTriangles and
+   wc_setupBounds, and their number is returned. The vectors only grow */
+template<class P, class D>
+static int SetupTriangles(const VectorPOD4f* vertices, int count, int samplePad, int maxX, int maxY)
+{
+	if(wc_setupTriangles.size() < (size_t)(count / 3)) {
+		wc_setupTriangles.resize(count / 3);
+		wc_setupBounds.resize(count / 3);
+	}
+	int n = 0;
+	int i = 0;
+#ifdef __SSE2__
+	for(; i + 12 <= count; i += 12)
+		n += SetupTriangles4<P, D>(vertices, i, samplePad, maxX, maxY, &wc_setupTriangles[n], &wc_setupBounds[n]);
+#endif
+	for(; i + 3 <= count; i += 3) {
+		if(SetupTriangle<P, D>(vertices, i, samplePad, maxX, maxY, wc_setupTriangles[n], wc_setupBounds[n]))
+			++n;
+	}
+	return n;
+}
+
+template<class P, unsigned int F, class D>
+static void DrawTrianglesTiled()
 {
 	using std::min;
 	using std::max;
 
 	const unsigned int width = wc_colorbuffer->w;
 	const unsigned int height = wc_colorbuffer->h;
-	const unsigned int numTilesX = (width >> Q);
-	const unsigned int numTilesY = (height >> Q);
+	const unsigned int numTilesX = (width >> P::Q);
+	const unsigned int numTilesY = (height >> P::Q);
 	const float fHalfWidthInv = 2.0f / (float)width;
 	const float fHalfHeightInv = 2.0f / (float)height;
-	const int NDC_x_step = fHalfWidthInv * f_ndc_precision; //1 subtracted later
-	const int NDC_y_step = fHalfHeightInv * f_ndc_precision; //1 subtracted later
-
-	if(wc_tileList.size() < (numTilesX * numTilesY))
-		wc_tileList.resize(numTilesX * numTilesY);
-	if(wc_tileListFilled.size() < (numTilesX * numTilesY))
-		wc_tileListFilled.resize(numTilesX * numTilesY);
-
-	for(int i = 0; i < wc_tileList.size(); ++i) {
-		wc_tileList[i].count = 0;
-	}
-	for(int i = 0; i < wc_tileListFilled.size(); ++i) {
-		wc_tileListFilled[i].count = 0;
-	}
-
-	const VectorPOD4f* vertices = &((*wc_vertices)[0]);
-	const VectorPOD4f* tcoords = &((*wc_tcoords0)[0]);
-
-	size_t len = wc_vertices->size();
-
-	for(int i=0; i<wc_vertices->size(); i+=3) {
-		const VectorPOD4f& v1 = vertices[i+0];
-		const VectorPOD4f& v2 = vertices[i+2];
-		const VectorPOD4f& v3 = vertices[i+1];
-
-		const VectorPOD4f& tc1 = tcoords[i+0];
-		const VectorPOD4f& tc2 = tcoords[i+1];
-		const VectorPOD4f& tc3 = tcoords[i+2];
-
-		// 28.4 fixed-point coordinates
-		const int Y1 = (int)(16.0f * v1.y);
-		const int Y2 = (int)(16.0f * v2.y);
-		const int Y3 = (int)(16.0f * v3.y);
-		const int X1 = (int)(16.0f * v1.x);
-		const int X2 = (int)(16.0f * v2.x);
-		const int X3 = (int)(16.0f * v3.x);
-
-		// Deltas
-		const int DX12 = X1 - X2;
-		const int DX23 = X2 - X3;
-		const int DX31 = X3 - X1;
-		const int DY12 = Y1 - Y2;
-		const int DY23 = Y2 - Y3;
-		const int DY31 = Y3 - Y1;
-
-		// Fixed-point deltas
-		const int FDX12 = DX12 << 4;
-		const int FDX23 = DX23 << 4;
-		const int FDX31 = DX31 << 4;
-		const int FDY12 = DY12 << 4;
-		const int FDY23 = DY23 << 4;
-		const int FDY31 = DY31 << 4;
-
-		// Bounding rectangle
-		int minx = (min(X1, min(X2, X3)) + 0xF) >> 4;
-		int maxx = (max(X1, max(X2, X3)) + 0xF) >> 4;
-		int miny = (min(Y1, min(Y2, Y3)) + 0xF) >> 4;
-		int maxy = (max(Y1, max(Y2, Y3)) + 0xF) >> 4;
-
-		// Start in corner of a 8x8 block alligned to block size
-		minx &= ~(q - 1);
-		miny &= ~(q - 1);
-		maxx = (maxx + (q - 1)) & ~(q - 1);
-		maxy = (maxy + (q - 1)) & ~(q - 1);
-
-		// Half-edge constants
-		int C1 = DY12 * X1 - DX12 * Y1;
-		int C2 = DY23 * X2 - DX23 * Y2;
-		int C3 = DY31 * X3 - DX31 * Y3;
-
-		// Correct for fill convention
-		if(DY12 < 0 || (DY12 == 0 && DX12 > 0)) C1++;
-		if(DY23 < 0 || (DY23 == 0 && DX23 > 0)) C2++;
-		if(DY31 < 0 || (DY31 == 0 && DX31 > 0)) C3++;
-
-		// Loop through blocks
-		for(int y = miny; y < maxy; y += q) {
-			for(int x = minx; x < maxx; x += q) {
-
-				// Corners of block
-				int x0 = x;
-				int x1 = (x + q - 1);
-				int y0 = y;
-				int y1 = (y + q - 1);
-
-				// test block against x and y frustum planes
-				bool px0min = x0 >= 0;
-				bool px0max = x0 < width;
-				bool py0min = y0 >= 0;
-				bool py0max = y0 < height;
-
-				bool px1min = x1 >= 0;
-				bool px1max = x1 < width;
-				bool py1min = y1 >= 0;
-				bool py1max = y1 < height;
-
-				int pflags0 = (px0min << 3) | (px1min << 2) | (px0max << 1) | px1max;
-				int pflags1 = (py0min << 3) | (py1min << 2) | (py0max << 1) | py1max;
-				int pflags = (pflags0<<4) | pflags1;
-
-				if(pflags != 0xFF)
-					continue;
+	const int NDC_x_step = fHalfWidthInv * (float)P::i_ndc_precision; //1 subtracted later
+	const int NDC_y_step = fHalfHeightInv * (float)P::i_ndc_precision; //1 subtracted later
+	const bool depthWrite = wc_depthWrite;
+	//With multisampling, blocks are tested at their outermost samples rather than
+	//their pixels. Then a block the test skips has no covered sample, and a filled
+	//one has every sample covered.
+	const int samplePad = wc_multisampling ? msaaSamplePad : 0;
+
+	if(TileBins<P>::tileList.size() < (numTilesX * numTilesY))
+		TileBins<P>::tileList.resize(numTilesX * numTilesY);
+	if(TileBins<P>::tileListFilled.size() < (numTilesX * numTilesY))
+		TileBins<P>::tileListFilled.resize(numTilesX * numTilesY);
+	//Unknown depth buffer contents, no culling until the next clear
+	if(TileBins<P>::hizMax.size() != (numTilesX * numTilesY)) {
+		TileBins<P>::hizMin.assign(numTilesX * numTilesY, 0);
+		TileBins<P>::hizMax.assign(numTilesX * numTilesY, P::depth_max);
+	}
+
+	wc_tileArena.Reset();
+	wc_triangles.clear();
+	wc_varyingCoeffs.clear();
+	for(size_t i = 0; i < TileBins<P>::tileList.size(); ++i) {
+		TileBins<P>::tileList[i].Clear();
+	}
+	for(size_t i = 0; i < TileBins<P>::tileListFilled.size(); ++i) {
+		TileBins<P>::tileListFilled[i].Clear();
+	}
+
+	const int numSetup = SetupTriangles<P, D>(wc_postVertices.data, wc_postVertices.size, samplePad,
+	                                          numTilesX << P::Q, numTilesY << P::Q);
+
+	for(int k = 0; k < numSetup; ++k) {
+		const TriangleSetup& tri = wc_setupTriangles[k];
+		const TriangleBounds& bounds = wc_setupBounds[k];
+		const int i = bounds.first;
+		const int minx = bounds.minx;
+		const int miny = bounds.miny;
+		const int maxx = bounds.maxx;
+		const int maxy = bounds.maxy;
+		const bool smallerThanTile = bounds.smallerThanTile;
+		const long long C1 = tri.C1, C2 = tri.C2, C3 = tri.C3;
+		const int DX12 = tri.DX12, DX23 = tri.DX23, DX31 = tri.DX31;
+		const int DY12 = tri.DY12, DY23 = tri.DY23, DY31 = tri.DY31;
+		const int triIdx = wc_triangles.size();
+
+		// Fast path for small triangles within one or two tiles. They can't fill
+		// a tile, so the tiles are binned as partial without edge tests. A tile
+		// the triangle passes by without covering a sample is binned too, and its
+		// pixel tests leave it untouched.
+		if(smallerThanTile && (maxx - minx) * (maxy - miny) <= 2 * P::q * P::q) {
+			bool binned = false;
+			for(int y = miny; y < maxy; y += P::q) {
+				for(int x = minx; x < maxx; x += P::q) {
+					if(BinTile<P, D>(tri, triIdx, x, y, false, depthWrite, numTilesX, NDC_x_step, NDC_y_step))
+						binned = true;
+				}
+			}
+			if(binned)
+				PushTriangle<P, F>(tri, i);
+			continue;
+		}
+
+		bool binned = false;
+
+		// Loop through macro tiles. Only the partially covered ones get
+		// refined, the others are rejected or accepted as a whole
+		for(int my = miny; my < maxy; my += P::mq) {
+			for(int mx = minx; mx < maxx; mx += P::mq) {
+				const int mx1 = min(mx + P::mq, maxx);
+				const int my1 = min(my + P::mq, maxy);
+				bool covered = false;
 
-				x0 <<= 4;
-				x1 <<= 4;
-				y0 <<= 4;
-				y1 <<= 4;
-
-				// Evaluate half-space functions
-				bool a00 = C1 + DX12 * y0 - DY12 * x0 > 0;
-				bool a10 = C1 + DX12 * y0 - DY12 * x1 > 0;
-				bool a01 = C1 + DX12 * y1 - DY12 * x0 > 0;
-				bool a11 = C1 + DX12 * y1 - DY12 * x1 > 0;
-
-				int a = (a00 << 0) | (a10 << 1) | (a01 << 2) | (a11 << 3);
-
-				bool b00 = C2 + DX23 * y0 - DY23 * x0 > 0;
-				bool b10 = C2 + DX23 * y0 - DY23 * x1 > 0;
-				bool b01 = C2 + DX23 * y1 - DY23 * x0 > 0;
-				bool b11 = C2 + DX23 * y1 - DY23 * x1 > 0;
-
-				int b = (b00 << 0) | (b10 << 1) | (b01 << 2) | (b11 << 3);
-
-				bool c00 = C3 + DX31 * y0 - DY31 * x0 > 0;
-				bool c10 = C3 + DX31 * y0 - DY31 * x1 > 0;
-				bool c01 = C3 + DX31 * y1 - DY31 * x0 > 0;
-				bool c11 = C3 + DX31 * y1 - DY31 * x1 > 0;
-
-				int c = (c00 << 0) | (c10 << 1) | (c01 << 2) | (c11 << 3);
-
-				// Skip block when outside an edge
-				if(a == 0x0 || b == 0x0 || c == 0x0) continue;
-
-				// Coefficients for the equation s/w = Ax + By + C
-				// Where x and y are in NDC space
-				const int Az = v1.z * f_depth_precision;
-				const int Bz = v3.z * f_depth_precision;
-				const int Cz = v2.z * f_depth_precision;
-				const int Aw = v1.w  * f_coeff_precision;
-				const int Bw = v3.w  * f_coeff_precision;
-				const int Cw = v2.w  * f_coeff_precision;
-				const int Au = tc1.x * f_coeff_precision;
-				const int Bu = tc2.x * f_coeff_precision;
-				const int Cu = tc3.x * f_coeff_precision;
-				const int Av = tc1.y * f_coeff_precision;
-				const int Bv = tc2.y * f_coeff_precision;
-				const int Cv = tc3.y * f_coeff_precision;
-
-				int NDC_x0 = x * NDC_x_step;  //min x
-				int NDC_y0 = y * NDC_y_step;  //min y
-				int NDC_x1 = (x + q - 1) * NDC_x_step; //max x
-				int NDC_y1 = (y + q - 1) * NDC_y_step; //max y
-
-				int bwx0 = (NDC_x0 - i_ndc_precision) >> base_diff;
-				int bwx1 = (NDC_x1 - i_ndc_precision) >> base_diff;
-				int bwy0 = (NDC_y0 - i_ndc_precision) >> base_diff;
-				int bwy1 = (NDC_y1 - i_ndc_precision) >> base_diff;
-
-				int bzx0 = (NDC_x0 - i_ndc_precision) >> base_diff_z;
-				int bzx1 = (NDC_x1 - i_ndc_precision) >> base_diff_z;
-				int bzy0 = (NDC_y0 - i_ndc_precision) >> base_diff_z;
-				int bzy1 = (NDC_y1 - i_ndc_precision) >> base_diff_z;
-
-				int bwi0 = ((Aw*bwx0 + Bw*bwy0) >> coeff_precision_base) + Cw; //top left
-				int bwi1 = ((Aw*bwx0 + Bw*bwy1) >> coeff_precision_base) + Cw; //bottom left
-				int bwi2 = ((Aw*bwx1 + Bw*bwy0) >> coeff_precision_base) + Cw; //top right
-				int bwi3 = ((Aw*bwx1 + Bw*bwy1) >> coeff_precision_base) + Cw; //bottom right
-
-				int bz0 = (((long long)Az*bzx0 + Bz*bzy0) >> depth_precision_base) + Cz; //top left
-				int bz1 = (((long long)Az*bzx0 + Bz*bzy1) >> depth_precision_base) + Cz; //bottom left
-				int bz2 = (((long long)Az*bzx1 + Bz*bzy0) >> depth_precision_base) + Cz; //top right
-				int bz3 = (((long long)Az*bzx1 + Bz*bzy1) >> depth_precision_base) + Cz; //bottom right
-
-				//Compute u for the corners of the tile
-				int bu0 = ((Au*bwx0 + Bu*bwy0) >> coeff_precision_base) + Cu; //top left
-				int bu1 = ((Au*bwx0 + Bu*bwy1) >> coeff_precision_base) + Cu; //bottom left
-				int bu2 = ((Au*bwx1 + Bu*bwy0) >> coeff_precision_base) + Cu; //top right
-				int bu3 = ((Au*bwx1 + Bu*bwy1) >> coeff_precision_base) + Cu; //bottom right
-
-				//Compute v for the corners of the tile
-				int bv0 = ((Av*bwx0 + Bv*bwy0) >> coeff_precision_base) + Cv; //top left
-				int bv1 = ((Av*bwx0 + Bv*bwy1) >> coeff_precision_base) + Cv; //bottom left
-				int bv2 = ((Av*bwx1 + Bv*bwy0) >> coeff_precision_base) + Cv; //top right
-				int bv3 = ((Av*bwx1 + Bv*bwy1) >> coeff_precision_base) + Cv; //bottom right
-
-				int bw0, bw1, bw2, bw3;
-				bw0 = bw1 = bw2 = bw3 = 0;
-
-				if(bwi0) bw0 = (1<<(coeff_precision_base * 2)) / bwi0;
-				if(bwi1) bw1 = (1<<(coeff_precision_base * 2)) / bwi1;
-				if(bwi2) bw2 = (1<<(coeff_precision_base * 2)) / bwi2;
-				if(bwi3) bw3 = (1<<(coeff_precision_base * 2)) / bwi3;
-
-				Tile tile;
-
-				tile.FDX12 = FDX12;
-				tile.FDX23 = FDX23;
-				tile.FDX31 = FDX31;
-				tile.FDY12 = FDY12;
-				tile.FDY23 = FDY23;
-				tile.FDY31 = FDY31;
-				tile.CY1 = C1 + DX12 * y0 - DY12 * x0;
-				tile.CY2 = C2 + DX23 * y0 - DY23 * x0;
-				tile.CY3 = C3 + DX31 * y0 - DY31 * x0;
-				tile.bw0 = bw0;
-				tile.bw1 = bw1;
-				tile.bw2 = bw2;
-				tile.bw3 = bw3;
-				tile.bz0 = bz0;
-				tile.bz1 = bz1;
-				tile.bz2 = bz2;
-				tile.bz3 = bz3;
-				tile.bu0 = bu0;
-				tile.bu1 = bu1;
-				tile.bu2 = bu2;
-				tile.bu3 = bu3;
-				tile.bv0 = bv0;
-				tile.bv1 = bv1;
-				tile.bv2 = bv2;
-				tile.bv3 = bv3;
-				tile.zMin = std::min(std::min(std::min(bz0, bz1), bz2), bz3);
-				tile.zMax = std::max(std::max(std::max(bz0, bz1), bz2), bz3);
-
-				int tileIdx = (x >> Q) + (y >> Q) * numTilesX;
-				// Accept whole block when totally covered
-				if(a == 0xF && b == 0xF && c == 0xF) {
-					int tileListIdx = wc_tileListFilled[tileIdx].count;
-					wc_tileListFilled[tileIdx].tiles[tileListIdx] = tile;
-					wc_tileListFilled[tileIdx].count++;
-				} else {
-					int tileListIdx = wc_tileList[tileIdx].count;
-					wc_tileList[tileIdx].tiles[tileListIdx] = tile;
-					wc_tileList[tileIdx].count++;
+				// Not worth it for one or two blocks
+				if((mx1 - mx) * (my1 - my) > 2 * P::q * P::q) {
+					// Corners of the macro tile
+					const int x0 = (mx << 4) - samplePad;
+					const int x1 = ((mx1 - 1) << 4) + samplePad;
+					const int y0 = (my << 4) - samplePad;
+					const int y1 = ((my1 - 1) << 4) + samplePad;
+
+					const int a = EdgeMask(C1, DX12, DY12, x0, x1, y0, y1);
+					const int b = EdgeMask(C2, DX23, DY23, x0, x1, y0, y1);
+					const int c = EdgeMask(C3, DX31, DY31, x0, x1, y0, y1);
+
+					// Skip macro tile when outside an edge
+					if(a == 0x0 || b == 0x0 || c == 0x0) continue;
+
+					covered = (a == 0xF && b == 0xF && c == 0xF);
+				}
+
+				// Loop through blocks
+				for(int y = my; y < my1; y += P::q) {
+					for(int x = mx; x < mx1; x += P::q) {
+						bool filled = true;
+						if(!covered) {
+							// Corners of block
+							const int x0 = (x << 4) - samplePad;
+							const int x1 = ((x + P::q - 1) << 4) + samplePad;
+							const int y0 = (y << 4) - samplePad;
+							const int y1 = ((y + P::q - 1) << 4) + samplePad;
+
+							// Evaluate half-space functions
+							const int a = EdgeMask(C1, DX12, DY12, x0, x1, y0, y1);
+							const int b = EdgeMask(C2, DX23, DY23, x0, x1, y0, y1);
+							const int c = EdgeMask(C3, DX31, DY31, x0, x1, y0, y1);
+
+							// Skip block when outside an edge
+							if(a == 0x0 || b == 0x0 || c == 0x0) continue;
+
+							filled = (a == 0xF && b == 0xF && c == 0xF);
+						}
+						if(BinTile<P, D>(tri, triIdx, x, y, filled, depthWrite, numTilesX, NDC_x_step, NDC_y_step))
+							binned = true;
+					}
 				}
 			}
 		}
+		if(binned)
+			PushTriangle<P, F>(tri, i);
 	}
-	BlitTilesFilled();
-	BlitTiles();
+	BlitTiles<P, F, D>();
+}
+
+/* DrawTrianglesTiled for the format of the bound depth buffer */
+template<class P, unsigned int F>
+static void DrawTrianglesDepth()
+{
+	switch(wc_depthFormat) {
+	case SR_DEPTH_24:
+	case SR_DEPTH_32:
+		DrawTrianglesTiled<P, F, DepthFixed>();
+		break;
+	case SR_DEPTH_FLOAT_REVERSED:
+		DrawTrianglesTiled<P, F, DepthFloat>();
+		break;
+	default:
+		DrawTrianglesTiled<P, F, Depth16>();
+		break;
+	}
+}
+
+/* Bins and blits the bound streams with the pipeline specialized for the
+   SR_Render flags F, which only interpolates the varyings F uses */
+template<unsigned int F>
+static void DrawTrianglesDeferred()
+{
+	switch(wc_tileSize) {
+	case SR_TILE_8X8:
+		DrawTrianglesDepth<Policy8x8, F>();
+		break;
+	case SR_TILE_32X32:
+		DrawTrianglesDepth<Policy32x32, F>();
+		break;
+	default:
+		DrawTrianglesDepth<Policy16x16, F>();
+		break;
+	}
+}
+
+/* The coarse depth buffer of the other tile sizes did not see
+   what was drawn with this one, so it can't be trusted anymore */
+template<class P>
+static void InvalidateHiZ()
+{
+	TileBins<P>::hizMin.clear();
+	TileBins<P>::hizMax.clear();
+}
+
+void SR_SetTileSize(int tileSize)
+{
+	if(tileSize != SR_TILE_8X8 && tileSize != SR_TILE_32X32)
+		tileSize = SR_TILE_16X16;
+	if(tileSize == wc_tileSize)
+		return;
+	wc_tileSize = tileSize;
+	InvalidateHiZ<Policy8x8>();
+	InvalidateHiZ<Policy16x16>();
+	InvalidateHiZ<Policy32x32>();
+}
+
+int SR_GetTileSize()
+{
+	return wc_tileSize;
+}
+
+void SR_SetDeferredTexturing(bool enable)
+{
+	wc_deferredTexturing = enable;
+}
+
+void SR_SetMultisampling(bool enable)
+{
+	wc_multisampling = enable;
+}
+
+void SR_BeginQuery()
+{
+	wc_queryActive = true;
+	wc_querySamples = 0;
+}
+
+unsigned int SR_EndQuery()
+{
+	wc_queryActive = false;
+	return wc_querySamples;
+}
+
+void SR_SetLight(float x, float y, float z, float ambient)
+{
+	const float len = std::sqrt(x*x + y*y + z*z);
+	if(len > 0.0f) {
+		wc_lightX = x / len;
+		wc_lightY = y / len;
+		wc_lightZ = z / len;
+	}
+	wc_ambient = clamp(ambient, 0.0f, 1.0f);
+}
+
+int SR_AutotuneTileSize(void (*cb_frame)(void*), void* data, int frames)
+{
+	//The default goes first, so it wins ties
+	const int tileSizes[] = {SR_TILE_16X16, SR_TILE_8X8, SR_TILE_32X32};
+	const int numTileSizes = sizeof(tileSizes) / sizeof(tileSizes[0]);
+	unsigned int bestTime = ~0u;
+	int best = SR_TILE_16X16;
+	for(int i = 0; i < numTileSizes; ++i) {
+		SR_SetTileSize(tileSizes[i]);
+		//Let the bins and arenas grow to size before timing
+		cb_frame(data);
+		const unsigned int t0 = SDL_GetTicks();
+		for(int j = 0; j < frames; ++j)
+			cb_frame(data);
+		const unsigned int t = SDL_GetTicks() - t0;
+		if(t < bestTime) {
+			bestTime = t;
+			best = tileSizes[i];
+		}
+	}
+	SR_SetTileSize(best);
+	return best;
 }
 
 bool ComputeCoeffMatrix(const VectorPOD4f& v1, const VectorPOD4f& v2, const VectorPOD4f& v3, MatrixPOD3f& m)
@@ -635,6 +2494,64 @@ bool ComputeCoeffMatrix(const VectorPOD4f& v1, const VectorPOD4f& v2, const Vect
 	return true;
 }
 
+#ifdef __SSE2__
+/* ComputeCoeffMatrix of 4 triangles in SoA registers, vertex j of triangle l
+   is v[3*l + j]. Returns the mask of the triangles that pass the degenerate and
+   backface tests, whose matrices go to m[0..3]. Same operations in the same
+   order, so the same matrices as ComputeCoeffMatrix. */
+static inline int ComputeCoeffMatrix4(const VectorPOD4f* const* v, MatrixPOD3f* m)
+{
+	//Rows of the matrices: x, y and w of each vertex
+	__m128 r[9];
+	for(int j = 0; j < 3; ++j) {
+		__m128 v0 = _mm_loadu_ps(&v[j]->x);
+		__m128 v1 = _mm_loadu_ps(&v[3 + j]->x);
+		__m128 v2 = _mm_loadu_ps(&v[6 + j]->x);
+		__m128 v3 = _mm_loadu_ps(&v[9 + j]->x);
+		_MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+		r[3*j + 0] = v0;
+		r[3*j + 1] = v1;
+		r[3*j + 2] = v3;
+	}
+	const __m128 det =
+	    _mm_add_ps(_mm_add_ps(
+	        _mm_mul_ps(r[0], _mm_sub_ps(_mm_mul_ps(r[4], r[8]), _mm_mul_ps(r[5], r[7]))),
+	        _mm_mul_ps(r[1], _mm_sub_ps(_mm_mul_ps(r[5], r[6]), _mm_mul_ps(r[3], r[8])))),
+	        _mm_mul_ps(r[2], _mm_sub_ps(_mm_mul_ps(r[3], r[7]), _mm_mul_ps(r[4], r[6]))));
+
+	//Not less than, so NaNs pass like in the scalar tests
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 pass = _mm_and_ps(_mm_cmpnlt_ps(_mm_andnot_ps(sign, det), _mm_set1_ps(0.0125f)),
+	                               _mm_cmpnlt_ps(det, _mm_setzero_ps()));
+	const int mask = _mm_movemask_ps(pass);
+	if(!mask)
+		return 0;
+
+	//Adjoint, from the cofactors, divided by the determinant
+	const __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	__m128 a[9];
+	a[0] = _mm_sub_ps(_mm_mul_ps(r[4], r[8]), _mm_mul_ps(r[5], r[7]));
+	a[3] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(r[3], r[8]), _mm_mul_ps(r[5], r[6])), sign);
+	a[6] = _mm_sub_ps(_mm_mul_ps(r[3], r[7]), _mm_mul_ps(r[4], r[6]));
+	a[1] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(r[1], r[8]), _mm_mul_ps(r[2], r[7])), sign);
+	a[4] = _mm_sub_ps(_mm_mul_ps(r[0], r[8]), _mm_mul_ps(r[2], r[6]));
+	a[7] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(r[0], r[7]), _mm_mul_ps(r[1], r[6])), sign);
+	a[2] = _mm_sub_ps(_mm_mul_ps(r[1], r[5]), _mm_mul_ps(r[2], r[4]));
+	a[5] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(r[0], r[5]), _mm_mul_ps(r[2], r[3])), sign);
+	a[8] = _mm_sub_ps(_mm_mul_ps(r[0], r[4]), _mm_mul_ps(r[1], r[3]));
+	float lanes[9][4];
+	for(int k = 0; k < 9; ++k)
+		_mm_storeu_ps(lanes[k], _mm_mul_ps(a[k], inv));
+	for(int l = 0; l < 4; ++l) {
+		if(mask & (1 << l)) {
+			for(int k = 0; k < 9; ++k)
+				m[l][k] = lanes[k][l];
+		}
+	}
+	return mask;
+}
+#endif
+
 inline static void SR_InterpTransform(float& f1, float& f2, float& f3, const MatrixPOD3f& m)
 {
 	/* Vector made up by one scalar from each vertex */
@@ -657,89 +2574,462 @@ inline static void SR_InterpTransform(VectorPOD4f& v1, VectorPOD4f& v2, VectorPO
 	SR_InterpTransform(v1.w, v2.w, v3.w, m);
 }
 
-void SR_Render(unsigned int flags)
+/* Screen space position of clip space vertex v. z is turned into z times w
+   (reversed z for SR_DEPTH_FLOAT_REVERSED), ready for SR_InterpTransform */
+static inline VectorPOD4f ProjectVertex(const VectorPOD4f& v, bool reversedZ)
 {
-	size_t oldSize = wc_vertices->size();
-	wc_vertices->reserve(oldSize * 2);
-	//Do the projection matrix multiply in main() instead, so we can make
-	//a big batch of triangles instead of many few.
-	/*
-	Matrix4f modelviewProjection = wc_projection * wc_modelview;
-	for(int i = 0; i < oldSize; i+=3){
-	  (*wc_vertices)[i+0] = modelviewProjection * (*wc_vertices)[i+0];
-	  (*wc_vertices)[i+1] = modelviewProjection * (*wc_vertices)[i+1];
-	  (*wc_vertices)[i+2] = modelviewProjection * (*wc_vertices)[i+2];
+	//Reversed z (1 at the near plane, 0 at the far plane) times w. Taken
+	//before the divide, so the far range keeps the precision of the float.
+	const float zw = 0.5f * (v.w - v.z);
+
+	//project() with the fast reciprocal, for w > 0 :
+	//Compute screen space coordinates for x and y
+	//Normalize z into [0.0f, 1.0f> half-range, Q0.16 fixedpoint
+	const float centerX = (float)wc_colorbuffer->w * 0.5f;
+	const float centerY = (float)wc_colorbuffer->h * 0.5f;
+	const float wInv = FastReci(v.w);
+	VectorPOD4f p;
+	p.x = v.x * wInv * centerX + centerX;
+	p.y = v.y * wInv * centerY + centerY;
+	p.z = v.z * wInv * 0.5f + 0.5f;
+	p.w = v.w;
+
+	//Must interpolate z linearly in screenspace!
+	//To get the coefficients required for an affine interpolation, simply multiply z with w
+	p.z = reversedZ ? zw : p.z * p.w;
+	return p;
+}
+
+/* Writes a triangle at vertex n of the output streams, with coefficients from m:
+   z and 1/w from its projected positions p, and its varyings from vertices
+   v[0..2] of the input streams. Stream 0 is the positions */
+static inline void EmitTriangle(const VectorPOD4f* const* in, VectorPOD4f* const* out, int numStreams,
+                                const size_t* v, const VectorPOD4f* p, size_t n, const MatrixPOD3f& m)
+{
+	VectorPOD4f* dst = out[0] + n;
+	dst[0] = p[0];
+	dst[1] = p[1];
+	dst[2] = p[2];
+	SR_InterpTransform(dst[0].z, dst[1].z, dst[2].z, m);
+
+	// To get "1.0f / w", multiply the 3D Vector [1,1,1] with the coefficient matrix.
+	// We don't need w (at the triangle vertices) anymore after this point.
+	dst[0].w = dst[1].w = dst[2].w = 1.0f;
+	SR_InterpTransform(dst[0].w, dst[1].w, dst[2].w, m);
+
+	/* Compute the coefficients for the rest of the per-vertex data */
+	for(int s = 1; s < numStreams; ++s) {
+		VectorPOD4f* c = out[s] + n;
+		c[0] = in[s][v[0]];
+		c[1] = in[s][v[1]];
+		c[2] = in[s][v[2]];
+		SR_InterpTransform(c[0], c[1], c[2], m);
 	}
-	*/
+}
+
+/* EmitTriangle for triangle list vertices i, i+1 and i+2, projected here */
+static inline void EmitListTriangle(const VectorPOD4f* const* in, VectorPOD4f* const* out, int numStreams,
+                                    size_t i, size_t n, const MatrixPOD3f& m, bool reversedZ)
+{
+	const size_t v[3] = {i, i + 1, i + 2};
+	const VectorPOD4f p[3] = {ProjectVertex(in[0][i+0], reversedZ),
+	                          ProjectVertex(in[0][i+1], reversedZ),
+	                          ProjectVertex(in[0][i+2], reversedZ)};
+	EmitTriangle(in, out, numStreams, v, p, n, m);
+}
+
+/* Makes room for n vertices in the post streams, keeping what they hold,
+   and points out at their data */
+static inline void GrowPostStreams(VertexStream* const* post, int numStreams, size_t n, VectorPOD4f** out)
+{
+	for(int s = 0; s < numStreams; ++s) {
+		if(post[s]->size < n)
+			post[s]->Resize(n);
+		out[s] = post[s]->data;
+	}
+}
+
+/* Emits the triangle list of the count vertices of the input streams, which
+   needs no clipping, to the post streams from vertex n on. Returns the new n */
+static size_t EmitTriangleList(const VectorPOD4f* const* in, VertexStream* const* post, int numStreams,
+                               size_t count, size_t n, bool reversedZ)
+{
+	VectorPOD4f* out[5];
+	GrowPostStreams(post, numStreams, n + count, out);
+
+	/* Compute [a,b,c] coefficients. Degenerate triangles,
+	   small triangles and backfaces are left out. 4 triangles
+	   at a time with SSE2, the tail one by one */
+	size_t i = 0;
+#ifdef __SSE2__
+	for(; i + 12 <= count; i += 12) {
+		const VectorPOD4f* v[12];
+		for(int k = 0; k < 12; ++k)
+			v[k] = in[0] + i + k;
+		MatrixPOD3f m[4];
+		const int mask = ComputeCoeffMatrix4(v, m);
+		for(int l = 0; l < 4; ++l) {
+			if(mask & (1 << l)) {
+				EmitListTriangle(in, out, numStreams, i + 3*l, n, m[l], reversedZ);
+				n += 3;
+			}
+		}
+	}
+#endif
+	for(; i + 3 <= count; i += 3) {
+		MatrixPOD3f m;
+		if(ComputeCoeffMatrix(in[0][i+0], in[0][i+1], in[0][i+2], m)) {
+			EmitListTriangle(in, out, numStreams, i, n, m, reversedZ);
+			n += 3;
+		}
+	}
+	return n;
+}
+
+//Outcodes and projected positions of the vertices of an indexed draw
+static std::vector<unsigned char> wc_vertexCodes;
+static VertexStream wc_vertexCache;
+//A triangle of an indexed draw that gets clipped, one entry per stream
+static VectorPOD4f wc_clipTriangle[5][3];
+
+/* EmitTriangle for the triangle of indices tri, projected in wc_vertexCache */
+static inline void EmitIndexedTriangle(const VectorPOD4f* const* in, VectorPOD4f* const* out, int numStreams,
+                                       const unsigned int* tri, size_t n, const MatrixPOD3f& m)
+{
+	const size_t v[3] = {tri[0], tri[1], tri[2]};
+	const VectorPOD4f p[3] = {wc_vertexCache.data[tri[0]],
+	                          wc_vertexCache.data[tri[1]],
+	                          wc_vertexCache.data[tri[2]]};
+	EmitTriangle(in, out, numStreams, v, p, n, m);
+}
 
-	for(int i = 0; i < oldSize; i+=3) {
-		/* Compute [a,b,c] coefficients */
+/* Emits the triangles of the count indices to the post streams, the numVertices
+   vertices of the input streams are each clipped and projected once. Triangles
+   that cross a clip plane are clipped on their own, in the order they are drawn.
+   The triangles go from vertex n on. Every index must be below numVertices.
+   Returns the new n */
+static size_t EmitIndexedTriangles(const VectorPOD4f* const* in, VertexStream* const* post, int numStreams,
+                                   size_t numVertices, const unsigned int* indices, size_t count,
+                                   size_t n, bool reversedZ)
+{
+	const int width = wc_colorbuffer->w;
+	const int height = wc_colorbuffer->h;
+	wc_vertexCodes.resize(numVertices);
+	wc_vertexCache.Resize(numVertices);
+	if(numVertices)
+		clip_outcodes(in[0], numVertices, width, height, &wc_vertexCodes[0]);
+	//Vertices outside a plane are only drawn clipped, and may have w <= 0
+	for(size_t i = 0; i < numVertices; ++i) {
+		if(!wc_vertexCodes[i])
+			wc_vertexCache.data[i] = ProjectVertex(in[0][i], reversedZ);
+	}
+	const unsigned char* codes = numVertices ? &wc_vertexCodes[0] : 0;
+
+	//Enough unless something gets clipped
+	VectorPOD4f* out[5];
+	GrowPostStreams(post, numStreams, n + count, out);
+	size_t t = 0;
+	while(t + 3 <= count) {
+		GrowPostStreams(post, numStreams, n + 12, out);
+#ifdef __SSE2__
+		//4 triangles at a time when none of them needs clipping
+		if(t + 12 <= count) {
+			unsigned int any = 0;
+			for(int k = 0; k < 12; ++k)
+				any |= codes[indices[t+k]];
+			if(!any) {
+				const VectorPOD4f* v[12];
+				for(int k = 0; k < 12; ++k)
+					v[k] = in[0] + indices[t+k];
+				MatrixPOD3f m[4];
+				const int mask = ComputeCoeffMatrix4(v, m);
+				for(int l = 0; l < 4; ++l) {
+					if(mask & (1 << l)) {
+						EmitIndexedTriangle(in, out, numStreams, indices + t + 3*l, n, m[l]);
+						n += 3;
+					}
+				}
+				t += 12;
+				continue;
+			}
+		}
+#endif
+		const unsigned int* tri = indices + t;
+		t += 3;
+		const unsigned int c0 = codes[tri[0]];
+		const unsigned int c1 = codes[tri[1]];
+		const unsigned int c2 = codes[tri[2]];
+		//Completely outside one of the planes
+		if(c0 & c1 & c2)
+			continue;
+		if(c0 | c1 | c2) {
+			const VectorPOD4f* clipIn[5];
+			for(int s = 0; s < numStreams; ++s) {
+				for(int j = 0; j < 3; ++j)
+					wc_clipTriangle[s][j] = in[s][tri[j]];
+				clipIn[s] = wc_clipTriangle[s];
+			}
+			const size_t clipped = clip_triangles(clipIn, numStreams, 3, width, height);
+			n = EmitTriangleList(clipIn, post, numStreams, clipped, n, reversedZ);
+			continue;
+		}
 		MatrixPOD3f m;
-		bool b = ComputeCoeffMatrix((*wc_vertices)[i+0], (*wc_vertices)[i+1], (*wc_vertices)[i+2], m);
-		//Skip degenerate triangles, small triangles and backfaces
-		if(!b) continue;
-
-		//Project() :
-		//Compute screen space coordinates for x and y
-		//Normalize z into [0.0f, 1.0f> half-range, Q0.16 fixedpoint
-		(*wc_vertices)[i+0] = project((*wc_vertices)[i+0], wc_colorbuffer->w, wc_colorbuffer->h);
-		(*wc_vertices)[i+1] = project((*wc_vertices)[i+1], wc_colorbuffer->w, wc_colorbuffer->h);
-		(*wc_vertices)[i+2] = project((*wc_vertices)[i+2], wc_colorbuffer->w, wc_colorbuffer->h);
-
-		//Must interpolate z linearly in screenspace!
-		//To get the coefficients required for an affine interpolation, simply multiply z with w
-		(*wc_vertices)[i+0].z *= (*wc_vertices)[i+0].w;
-		(*wc_vertices)[i+1].z *= (*wc_vertices)[i+1].w;
-		(*wc_vertices)[i+2].z *= (*wc_vertices)[i+2].w;
-		SR_InterpTransform((*wc_vertices)[i+0].z, (*wc_vertices)[i+1].z, (*wc_vertices)[i+2].z, m);
-
-		// To get "1.0f / w", multiply the 3D Vector [1,1,1] with the coefficient matrix.
-		// We don't need w (at the triangle vertices) anymore after this point.
-		(*wc_vertices)[i+0].w = (*wc_vertices)[i+1].w = (*wc_vertices)[i+2].w = 1.0f;
-		SR_InterpTransform((*wc_vertices)[i+0].w, (*wc_vertices)[i+1].w, (*wc_vertices)[i+2].w, m);
-
-		/* Compute the coefficients for the rest of the per-vertex data */
-		if(flags & SR_TEXCOORD0)
-			SR_InterpTransform((*wc_tcoords0)[i+0], (*wc_tcoords0)[i+1], (*wc_tcoords0)[i+2], m);
-		if(flags & SR_TEXCOORD1)
-			SR_InterpTransform((*wc_tcoords1)[i+0], (*wc_tcoords1)[i+1], (*wc_tcoords1)[i+2], m);
-		if(flags & SR_LIGHTING)
-			SR_InterpTransform((*wc_normals)[i+0], (*wc_normals)[i+1], (*wc_normals)[i+2], m);
-		if(flags & SR_COLOR)
-			SR_InterpTransform((*wc_colors)[i+0], (*wc_colors)[i+1], (*wc_colors)[i+2], m);
-
-		wc_vertices->push_back((*wc_vertices)[i+0]);
-		wc_vertices->push_back((*wc_vertices)[i+1]);
-		wc_vertices->push_back((*wc_vertices)[i+2]);
-		wc_tcoords0->push_back((*wc_tcoords0)[i+0]);
-		wc_tcoords0->push_back((*wc_tcoords0)[i+1]);
-		wc_tcoords0->push_back((*wc_tcoords0)[i+2]);
-	}
-	//reuse these arrays but delete the previous data copy
-	wc_vertices->erase(wc_vertices->begin(), wc_vertices->begin() + oldSize);
-	wc_tcoords0->erase(wc_tcoords0->begin(), wc_tcoords0->begin() + oldSize);
-
-	switch(flags) {
+		if(ComputeCoeffMatrix(in[0][tri[0]], in[0][tri[1]], in[0][tri[2]], m)) {
+			EmitIndexedTriangle(in, out, numStreams, tri, n, m);
+			n += 3;
+		}
+	}
+	return n;
+}
+
+//The triangles of a strip or fan draw, or the valid ones of an index list
+//that has some out of range, three indices each
+static std::vector<unsigned int> wc_primitiveIndices;
+//The indices the draw uses, either the bound ones or wc_primitiveIndices.
+//Without wc_drawIndexed the streams are drawn as a triangle list
+static bool wc_drawIndexed = false;
+static const unsigned int* wc_drawIndices = 0;
+static size_t wc_drawIndexCount = 0;
+
+/* Makes the triangles of the strips or fans of the count indices, or of the
+   vertices 0 to count-1 when indices is NULL, into wc_primitiveIndices.
+   The triangles with a repeated vertex, that join strips together, and the
+   ones with an index of numVertices or more are left out */
+static void ExpandPrimitives(unsigned int primitive, const unsigned int* indices, size_t count, size_t numVertices)
+{
+	wc_primitiveIndices.resize(count > 2 ? (count - 2) * 3 : 0);
+	unsigned int* out = wc_primitiveIndices.empty() ? 0 : &wc_primitiveIndices[0];
+	size_t n = 0;
+	//Vertices since the last restart, and the two before this one
+	size_t k = 0;
+	unsigned int a = 0, b = 0;
+	for(size_t i = 0; i < count; ++i) {
+		const unsigned int c = indices ? indices[i] : (unsigned int)i;
+		if(c == SR_PRIMITIVE_RESTART && indices) {
+			k = 0;
+			continue;
+		}
+		if(k >= 2 && a != b && a != c && b != c && a < numVertices && b < numVertices && c < numVertices) {
+			//Odd triangles of a strip are flipped to keep the winding
+			const bool flip = primitive == SR_TRIANGLE_STRIP && (k & 1);
+			out[n+0] = flip ? b : a;
+			out[n+1] = flip ? a : b;
+			out[n+2] = c;
+			n += 3;
+		}
+		//A fan keeps its first vertex
+		if(primitive == SR_TRIANGLE_STRIP || k == 1)
+			a = b;
+		b = c;
+		++k;
+	}
+	wc_primitiveIndices.resize(n);
+}
+
+/* Copies the triangles of the count indices that only use vertices below
+   numVertices to wc_primitiveIndices */
+static void DropInvalidTriangles(const unsigned int* indices, size_t count, size_t numVertices)
+{
+	wc_primitiveIndices.clear();
+	for(size_t t = 0; t + 3 <= count; t += 3) {
+		if(indices[t] < numVertices && indices[t+1] < numVertices && indices[t+2] < numVertices)
+			wc_primitiveIndices.insert(wc_primitiveIndices.end(), indices + t, indices + t + 3);
+	}
+}
+
+static inline const VectorPOD4f* StreamData(const std::vector<VectorPOD4f>* stream)
+{
+	return stream->empty() ? 0 : &(*stream)[0];
+}
+
+/* Picks the streams for flags, positions first, and empties the post streams
+   the triangles that get drawn go to. Sets up the indices to draw with, if
+   any, without the triangles that use a vertex past the end of the streams.
+   Returns the number of streams */
+static int BeginDraw(unsigned int& flags, const VectorPOD4f** in, VertexStream** post)
+{
+	//Only the positions matter for the depth
+	if(flags & SR_DEPTH_ONLY)
+		flags &= SR_DEPTH_ONLY | SR_DEPTH_EQUAL | SR_NO_DEPTH_WRITE;
+	wc_depthEqual = (flags & SR_DEPTH_EQUAL) != 0;
+	wc_depthWrite = !(flags & (SR_DEPTH_EQUAL | SR_NO_DEPTH_WRITE));
+
+	//The bound streams are only read
+	int numStreams = 0;
+	in[numStreams] = StreamData(wc_vertices);
+	post[numStreams++] = &wc_postVertices;
+	if(flags & SR_TEXCOORD0) {
+		in[numStreams] = StreamData(wc_tcoords0);
+		post[numStreams++] = &wc_postTcoords0;
+	}
+	if(flags & SR_TEXCOORD1) {
+		in[numStreams] = StreamData(wc_tcoords1);
+		post[numStreams++] = &wc_postTcoords1;
+	}
+	if(flags & SR_LIGHTING) {
+		in[numStreams] = StreamData(wc_normals);
+		post[numStreams++] = &wc_postNormals;
+	}
+	if(flags & SR_COLOR) {
+		in[numStreams] = StreamData(wc_colors);
+		post[numStreams++] = &wc_postColors;
+	}
+	for(int s = 0; s < numStreams; ++s)
+		post[s]->Resize(0);
+
+	//The indices are made into triangles and checked once, for every instance
+	const unsigned int* indices = wc_indices && !wc_indices->empty() ? &(*wc_indices)[0] : 0;
+	const size_t numVertices = wc_vertices->size();
+	wc_drawIndexed = wc_primitive != SR_TRIANGLES || wc_indices;
+	wc_drawIndices = indices;
+	wc_drawIndexCount = wc_indices ? wc_indices->size() : 0;
+	if(wc_primitive != SR_TRIANGLES) {
+		ExpandPrimitives(wc_primitive, indices, wc_indices ? wc_indices->size() : numVertices, numVertices);
+		wc_drawIndices = wc_primitiveIndices.empty() ? 0 : &wc_primitiveIndices[0];
+		wc_drawIndexCount = wc_primitiveIndices.size();
+	} else if(indices) {
+		unsigned int maxIndex = 0;
+		for(size_t i = 0; i < wc_drawIndexCount; ++i)
+			maxIndex = std::max(maxIndex, indices[i]);
+		//Out of range, or an SR_PRIMITIVE_RESTART in a list
+		if(maxIndex >= numVertices) {
+			DropInvalidTriangles(indices, wc_drawIndexCount, numVertices);
+			wc_drawIndices = wc_primitiveIndices.empty() ? 0 : &wc_primitiveIndices[0];
+			wc_drawIndexCount = wc_primitiveIndices.size();
+		}
+	}
+	return numStreams;
+}
+
+/* Emits the triangles of the numVertices vertices of the streams, with the
+   indices BeginDraw picked, to the post streams from vertex n on.
+   Returns the new n */
+static size_t EmitDraw(const VectorPOD4f* const* streams, VertexStream* const* post, int numStreams,
+                       size_t numVertices, size_t n)
+{
+	const bool reversedZ = wc_depthFormat == SR_DEPTH_FLOAT_REVERSED;
+	//Neighbouring triangles of strips and fans share two vertices, so they
+	//are drawn indexed too, which projects each vertex once
+	if(wc_drawIndexed)
+		return EmitIndexedTriangles(streams, post, numStreams, numVertices, wc_drawIndices, wc_drawIndexCount, n, reversedZ);
+	//Near/far and guard band clipping, the setup below can't handle w <= 0.
+	//It swaps in clipped copies of the streams
+	const VectorPOD4f* in[5];
+	for(int s = 0; s < numStreams; ++s)
+		in[s] = streams[s];
+	const size_t count = clip_triangles(in, numStreams, numVertices, wc_colorbuffer->w, wc_colorbuffer->h);
+	return EmitTriangleList(in, post, numStreams, count, n, reversedZ);
+}
+
+/* Draws the n vertices of triangles in the post streams */
+static void FinishDraw(unsigned int flags, VertexStream* const* post, int numStreams, size_t n)
+{
+	for(int s = 0; s < numStreams; ++s)
+		post[s]->Resize(n);
+
+	if(flags & SR_DEPTH_ONLY) {
+		DrawTrianglesDeferred<SR_DEPTH_ONLY>();
+		return;
+	}
+	//One pipeline for every combination of flags, each only
+	//interpolates the varyings it uses
+	switch(flags & (SR_TEXCOORD0 | SR_TEXCOORD1 | SR_LIGHTING | SR_COLOR)) {
 	case SR_TEXCOORD0:
+		DrawTrianglesDeferred<SR_TEXCOORD0>();
+		break;
 	case SR_TEXCOORD1:
+		DrawTrianglesDeferred<SR_TEXCOORD1>();
+		break;
 	case SR_LIGHTING:
+		DrawTrianglesDeferred<SR_LIGHTING>();
+		break;
 	case SR_COLOR:
+		DrawTrianglesDeferred<SR_COLOR>();
+		break;
 	case (SR_TEXCOORD0 | SR_TEXCOORD1):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_TEXCOORD1>();
+		break;
 	case (SR_TEXCOORD0 | SR_LIGHTING):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_LIGHTING>();
+		break;
 	case (SR_TEXCOORD0 | SR_COLOR):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_COLOR>();
+		break;
 	case (SR_TEXCOORD1 | SR_LIGHTING):
+		DrawTrianglesDeferred<SR_TEXCOORD1 | SR_LIGHTING>();
+		break;
 	case (SR_TEXCOORD1 | SR_COLOR):
+		DrawTrianglesDeferred<SR_TEXCOORD1 | SR_COLOR>();
+		break;
 	case (SR_LIGHTING | SR_COLOR):
+		DrawTrianglesDeferred<SR_LIGHTING | SR_COLOR>();
+		break;
 	case (SR_TEXCOORD0 | SR_TEXCOORD1 | SR_LIGHTING):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_TEXCOORD1 | SR_LIGHTING>();
+		break;
 	case (SR_TEXCOORD0 | SR_TEXCOORD1 | SR_COLOR):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_TEXCOORD1 | SR_COLOR>();
+		break;
 	case (SR_TEXCOORD0 | SR_LIGHTING | SR_COLOR):
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_LIGHTING | SR_COLOR>();
+		break;
 	case (SR_TEXCOORD1 | SR_LIGHTING | SR_COLOR):
+		DrawTrianglesDeferred<SR_TEXCOORD1 | SR_LIGHTING | SR_COLOR>();
+		break;
 	case (SR_TEXCOORD0 | SR_TEXCOORD1 | SR_LIGHTING | SR_COLOR):
-	case 0: {
+		DrawTrianglesDeferred<SR_TEXCOORD0 | SR_TEXCOORD1 | SR_LIGHTING | SR_COLOR>();
+		break;
+	case 0:
+		DrawTrianglesDeferred<0>();
+		break;
+	}
+}
 
+void SR_Render(unsigned int flags)
+{
+	const VectorPOD4f* in[5];
+	VertexStream* post[5];
+	const int numStreams = BeginDraw(flags, in, post);
+
+	//Do the projection matrix multiply in main() instead, so we can make
+	//a big batch of triangles instead of many few.
+	/*
+	Matrix4f modelviewProjection = wc_projection * wc_modelview;
+	for(int i = 0; i < oldSize; i+=3){
+	  (*wc_vertices)[i+0] = modelviewProjection * (*wc_vertices)[i+0];
+	  (*wc_vertices)[i+1] = modelviewProjection * (*wc_vertices)[i+1];
+	  (*wc_vertices)[i+2] = modelviewProjection * (*wc_vertices)[i+2];
 	}
+	*/
+	FinishDraw(flags, post, numStreams, EmitDraw(in, post, numStreams, wc_vertices->size(), 0));
+}
+
+//Positions of the instance being drawn
+static VertexStream wc_instanceVertices;
+//SR_RenderInstanced draws what it has emitted once the post streams hold this
+//many vertices, so they don't grow with the number of instances
+const size_t instanceBatchVertices = 3 << 15;
+
+void SR_RenderInstanced(unsigned int flags, const MatrixPOD4f* matrices, int numInstances)
+{
+	const VectorPOD4f* in[5];
+	VertexStream* post[5];
+	const int numStreams = BeginDraw(flags, in, post);
+	const size_t numVertices = wc_vertices->size();
+	wc_instanceVertices.Resize(numVertices);
+	const VectorPOD4f* vertices = in[0];
+	//The other streams are shared by every instance
+	in[0] = wc_instanceVertices.data;
+	size_t n = 0;
+	for(int i = 0; i < numInstances; ++i) {
+		SR_TransformBatch(matrices[i], vertices, wc_instanceVertices.data, numVertices);
+		n = EmitDraw(in, post, numStreams, numVertices, n);
+		if(n >= instanceBatchVertices && i + 1 < numInstances) {
+			FinishDraw(flags, post, numStreams, n);
+			for(int s = 0; s < numStreams; ++s)
+				post[s]->Resize(0);
+			n = 0;
+		}
 	}
-	//switch not done yet, so just call the test rasterizer
-	//DrawTriangles(flags);
-	DrawTrianglesDeferred(flags);
+	FinishDraw(flags, post, numStreams, n);
 }
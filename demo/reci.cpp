@@ -1,47 +1,28 @@
 #include <linealg.h>
+#include <fastmath.h>
+
+float wc_reciSeeds[256];
+
+/* Fills wc_reciSeeds before main() */
+static struct ReciSeedsInit {
+	ReciSeedsInit() {
+		for(int i = 0; i < 256; ++i)
+			wc_reciSeeds[i] = 1.0f / (1.0f + ((float)i + 0.5f) / 256.0f);
+	}
+} reciSeedsInit;
 
 int reci11(int val)
 {
-	int ret;
-	asm volatile (
-	     "xorl %%edx, %%edx;\n"
-	     "movl $0x400000, %%eax;\n"
-	     "idiv %0;\n"
-	     "movl  %%eax, %1\n"
-	     :"=r"(ret)
-	     :"r"(val)
-	     :"%eax", "%edx"
-	);
-	return ret;
+	return FixedReci<22>(val);
 }
 
 
 int reci15(int val)
 {
-	int ret;
-	asm volatile (
-	     "xorl %%edx, %%edx;\n"
-	     "movl $0x40000000, %%eax;\n"
-	     "idiv %0;\n"
-	     "movl  %%eax, %1\n"
-	     :"=r"(ret)
-	     :"r"(val)
-	     :"%eax", "%edx"
-	);
-	return ret;
+	return FixedReci<30>(val);
 }
 
 int reci8(int val)
 {
-	int ret;
-	asm volatile (
-	     "xorl %%edx, %%edx;\n"
-	     "movl $0x100, %%eax;\n"
-	     "idiv %0;\n"
-	     "movl  %%eax, %1\n"
-	     :"=r"(ret)
-	     :"r"(val)
-	     :"%eax", "%edx"
-	);
-	return ret;
+	return FixedReci<8>(val);
 }
@@ -1,14 +1,44 @@
+#include <cstdlib>
+#include <cstring>
 #include "vertexdata.h"
+#include "framebuffer.h"
 
 std::vector<VectorPOD4f>* wc_vertices;
 std::vector<VectorPOD4f>* wc_tcoords0;
 std::vector<VectorPOD4f>* wc_tcoords1;
 std::vector<VectorPOD4f>* wc_normals;
 std::vector<VectorPOD4f>* wc_colors;
+std::vector<unsigned int>* wc_indices;
+unsigned int wc_primitive = SR_TRIANGLES;
 
 Matrix4f wc_modelview;
 Matrix4f wc_projection;
 
+VertexStream::VertexStream() : data(0), size(0), block(0), capacity(0)
+{
+}
+
+VertexStream::~VertexStream()
+{
+	free(block);
+}
+
+void VertexStream::Resize(size_t n)
+{
+	if(n > capacity) {
+		//Grow in steps, and align by hand since malloc only promises 8 bytes
+		capacity = n + n / 2;
+		void* grown = malloc(capacity * sizeof(VectorPOD4f) + 15);
+		VectorPOD4f* grownData = (VectorPOD4f*)(((size_t)grown + 15) & ~(size_t)15);
+		if(size)
+			memcpy(grownData, data, size * sizeof(VectorPOD4f));
+		free(block);
+		block = grown;
+		data = grownData;
+	}
+	size = n;
+}
+
 void SR_SetVertices(std::vector<VectorPOD4f>* vertices)
 {
 	wc_vertices = vertices;
@@ -30,6 +60,53 @@ void SR_SetColors(std::vector<VectorPOD4f>* colors)
 	wc_colors = colors;
 }
 
+void SR_SetIndices(std::vector<unsigned int>* indices)
+{
+	wc_indices = indices;
+}
+
+void SR_SetPrimitive(unsigned int primitive)
+{
+	wc_primitive = primitive;
+}
+
+void SR_TransformBatch(const MatrixPOD4f& matrix, const VectorPOD4f* in, VectorPOD4f* out,
+                       size_t count, unsigned int flags)
+{
+	const bool proj = (flags & SR_TRANSFORM_PROJECT) != 0;
+	const float width = proj ? (float)wc_colorbuffer->w : 0.0f;
+	const float height = proj ? (float)wc_colorbuffer->h : 0.0f;
+	size_t i = 0;
+#ifdef __SSE2__
+	//A column of the matrix per input component, summed in the order
+	//Mat4Vec4Mul does, so the results are the same
+	const __m128 c0 = _mm_setr_ps(matrix[0], matrix[4], matrix[8], matrix[12]);
+	const __m128 c1 = _mm_setr_ps(matrix[1], matrix[5], matrix[9], matrix[13]);
+	const __m128 c2 = _mm_setr_ps(matrix[2], matrix[6], matrix[10], matrix[14]);
+	const __m128 c3 = _mm_setr_ps(matrix[3], matrix[7], matrix[11], matrix[15]);
+	//project() is v / w * scale + scale, keeping w
+	const __m128 scale = _mm_setr_ps(width * 0.5f, height * 0.5f, 0.5f, 0.0f);
+	const __m128 keepW = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+	for(; i < count; ++i) {
+		const __m128 v = _mm_loadu_ps(&in[i].x);
+		__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+		r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+		if(proj) {
+			const __m128 w = _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3));
+			const __m128 p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r, _mm_div_ps(_mm_set1_ps(1.0f), w)), scale), scale);
+			r = _mm_or_ps(_mm_andnot_ps(keepW, p), _mm_and_ps(keepW, r));
+		}
+		_mm_storeu_ps(&out[i].x, r);
+	}
+#endif
+	for(; i < count; ++i) {
+		const VectorPOD4f r = Mat4Vec4Mul(matrix, in[i]);
+		out[i] = proj ? project(r, width, height) : r;
+	}
+}
+
 void SR_SetModelViewMatrix(const Matrix4f& matrix)
 {
 	wc_modelview = matrix;
@@ -9,12 +9,55 @@ const unsigned int SR_TEXCOORD0 = 1;
 const unsigned int SR_TEXCOORD1 = 2;
 const unsigned int SR_LIGHTING = 4;
 const unsigned int SR_COLOR = 8;
+//Depth prepass: bins and writes depth only, no shading and no color writes.
+//The varyings are ignored
+const unsigned int SR_DEPTH_ONLY = 16;
+//Only pixels whose depth equals the depth buffer pass, and the depth buffer
+//is left as is. For the color pass after SR_DEPTH_ONLY with the same geometry,
+//which shades every pixel once. Pixels at the far plane never pass. With
+//SR_DEPTH_16 two triangles can round to the same depth at a pixel; both pass,
+//so the last one drawn wins where a single pass would keep the first
+const unsigned int SR_DEPTH_EQUAL = 32;
+//Tests depth, but leaves the depth buffer as is. With SR_DEPTH_ONLY, for the
+//bounding volumes drawn in an occlusion query (see SR_BeginQuery)
+const unsigned int SR_NO_DEPTH_WRITE = 64;
+
+/* Primitives for SR_SetPrimitive */
+//Three vertices per triangle
+const unsigned int SR_TRIANGLES = 0;
+//Every vertex after the first two makes a triangle with the two before it.
+//Every other triangle is flipped, so they all keep the winding of the first
+const unsigned int SR_TRIANGLE_STRIP = 1;
+//Every vertex after the first two makes a triangle with the one before it
+//and the first one
+const unsigned int SR_TRIANGLE_FAN = 2;
+//In the index list of a strip or fan, ends it and starts the next one
+const unsigned int SR_PRIMITIVE_RESTART = 0xFFFFFFFF;
+
+/* Array of vectors owned by the renderer, 16-byte aligned for SSE loads and
+   stores. Keeps its memory when it shrinks, so it stops allocating once warmed up */
+struct VertexStream {
+	VertexStream();
+	~VertexStream();
+	//Makes room for n vectors, keeping the first ones
+	void Resize(size_t n);
+
+	VectorPOD4f* data;
+	size_t size;
+private:
+	VertexStream(const VertexStream&);
+	VertexStream& operator=(const VertexStream&);
+	void* block;
+	size_t capacity;
+};
 
 extern std::vector<VectorPOD4f>* wc_vertices;
 extern std::vector<VectorPOD4f>* wc_tcoords0;
 extern std::vector<VectorPOD4f>* wc_tcoords1;
 extern std::vector<VectorPOD4f>* wc_normals;
 extern std::vector<VectorPOD4f>* wc_colors;
+extern std::vector<unsigned int>* wc_indices;
+extern unsigned int wc_primitive;
 
 extern Matrix4f wc_modelview;
 extern Matrix4f wc_projection;
@@ -23,7 +66,25 @@ void SR_SetVertices(std::vector<VectorPOD4f>* vertices);
 void SR_SetTexCoords0(std::vector<VectorPOD4f>* tcoords0);
 void SR_SetTexCoords1(std::vector<VectorPOD4f>* tcoords1);
 void SR_SetNormals(std::vector<VectorPOD4f>* normals);
-void SR_SetColors(std::vector<VectorPOD4f>* normals);
+void SR_SetColors(std::vector<VectorPOD4f>* colors); //r, g, b in [0, 1]
+/* Index list for SR_Render, three vertices of the streams per triangle. Each
+   vertex is then projected once, however many triangles share it. Triangles
+   with an index past the end of the streams are left out. NULL, the default,
+   draws the streams themselves as a triangle list */
+void SR_SetIndices(std::vector<unsigned int>* indices);
+/* How SR_Render makes triangles of the vertices, or of the indices when
+   there are some. SR_TRIANGLES by default */
+void SR_SetPrimitive(unsigned int primitive);
+
+/* Flags for SR_TransformBatch */
+//Also divides by w and maps to the viewport of the color buffer like project()
+const unsigned int SR_TRANSFORM_PROJECT = 1;
+
+/* out[i] = matrix * in[i] for count vectors, the same as Mat4Vec4Mul with
+   a whole vector per SSE operation. out must have room for count vectors,
+   and may be the same array as in */
+void SR_TransformBatch(const MatrixPOD4f& matrix, const VectorPOD4f* in, VectorPOD4f* out,
+                       size_t count, unsigned int flags = 0);
 
 void SR_SetModelViewMatrix(const Matrix4f& matrix);
 void SR_SetProjectionMatrix(const Matrix4f& matrix);
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <SDL/SDL.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "workers.h"
+#include "myassert.h"
+
+const int maxWorkers = 64;
+
+/* Each worker owns a run [head, tail> of the item array.
+   The owner pops from the head, thieves take from the tail. */
+struct WorkQueue {
+	SDL_mutex* lock;
+	int head;
+	int tail;
+	char pad[64 - sizeof(SDL_mutex*) - 2*sizeof(int)]; //keep queues on separate cache lines
+};
+
+static SDL_Thread* wc_threads[maxWorkers];
+static WorkQueue wc_queues[maxWorkers];
+static SDL_sem* wc_startSem = 0;
+static SDL_sem* wc_doneSem = 0;
+static int wc_numWorkers = 1;
+static bool wc_quitWorkers = false;
+
+//The job currently being run, set up by SR_RunJobs before the workers wake up
+static SR_JobFunc wc_job;
+static void* wc_jobData;
+static const int* wc_jobItems;
+
+static int NumCores()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+static bool PopItem(WorkQueue& q, bool steal, int& item)
+{
+	SDL_mutexP(q.lock);
+	bool found = q.head < q.tail;
+	if(found)
+		item = steal ? wc_jobItems[--q.tail] : wc_jobItems[q.head++];
+	SDL_mutexV(q.lock);
+	return found;
+}
+
+static void WorkLoop(int worker)
+{
+	int item;
+	while(PopItem(wc_queues[worker], false, item))
+		wc_job(item, worker, wc_jobData);
+	//Our own run is done, help the others. Queues are never refilled
+	//during a run, so one pass over the victims is enough.
+	for(int i = 1; i < wc_numWorkers; ++i) {
+		WorkQueue& victim = wc_queues[(worker + i) % wc_numWorkers];
+		while(PopItem(victim, true, item))
+			wc_job(item, worker, wc_jobData);
+	}
+}
+
+static int WorkerThread(void* data)
+{
+	int worker = (int)(size_t)data;
+	for(;;) {
+		SDL_SemWait(wc_startSem);
+		if(wc_quitWorkers)
+			break;
+		WorkLoop(worker);
+		SDL_SemPost(wc_doneSem);
+	}
+	return 0;
+}
+
+void SR_InitWorkers(int numThreads)
+{
+	if(wc_startSem)
+		SR_QuitWorkers();
+	if(numThreads <= 0)
+		numThreads = NumCores();
+	wc_numWorkers = std::min(std::max(numThreads, 1), maxWorkers);
+	wc_quitWorkers = false;
+	wc_startSem = SDL_CreateSemaphore(0);
+	wc_doneSem = SDL_CreateSemaphore(0);
+	for(int i = 0; i < wc_numWorkers; ++i) {
+		wc_queues[i].lock = SDL_CreateMutex();
+		wc_queues[i].head = wc_queues[i].tail = 0;
+	}
+	//Worker 0 is the calling thread
+	for(int i = 1; i < wc_numWorkers; ++i)
+		wc_threads[i] = SDL_CreateThread(WorkerThread, (void*)(size_t)i);
+}
+
+void SR_QuitWorkers()
+{
+	if(!wc_startSem)
+		return;
+	wc_quitWorkers = true;
+	for(int i = 1; i < wc_numWorkers; ++i)
+		SDL_SemPost(wc_startSem);
+	for(int i = 1; i < wc_numWorkers; ++i)
+		SDL_WaitThread(wc_threads[i], NULL);
+	for(int i = 0; i < wc_numWorkers; ++i)
+		SDL_DestroyMutex(wc_queues[i].lock);
+	SDL_DestroySemaphore(wc_startSem);
+	SDL_DestroySemaphore(wc_doneSem);
+	wc_startSem = wc_doneSem = 0;
+	wc_numWorkers = 1;
+}
+
+int SR_NumWorkers()
+{
+	return wc_numWorkers;
+}
+
+void SR_RunJobs(SR_JobFunc job, void* data, const int* items, const int* costs, int numItems)
+{
+	if(numItems <= 0)
+		return;
+	if(!wc_startSem || wc_numWorkers == 1) {
+		for(int i = 0; i < numItems; ++i)
+			job(items[i], 0, data);
+		return;
+	}
+	wc_job = job;
+	wc_jobData = data;
+	wc_jobItems = items;
+
+	//Split the items into runs of equal total cost, one per worker.
+	//Every item costs at least 1, so empty ones are spread out as well.
+	long long total = 0;
+	for(int i = 0; i < numItems; ++i)
+		total += (costs ? costs[i] : 0) + 1;
+	for(int w = 0; w < wc_numWorkers; ++w)
+		wc_queues[w].head = wc_queues[w].tail = numItems;
+	int w = 0;
+	long long accum = 0;
+	wc_queues[0].head = 0;
+	for(int i = 0; i < numItems; ++i) {
+		while(w < wc_numWorkers - 1 && accum * wc_numWorkers >= total * (w + 1)) {
+			wc_queues[w].tail = i;
+			wc_queues[++w].head = i;
+		}
+		accum += (costs ? costs[i] : 0) + 1;
+	}
+	ASSERT(wc_queues[w].tail == numItems);
+
+	for(int i = 1; i < wc_numWorkers; ++i)
+		SDL_SemPost(wc_startSem);
+	WorkLoop(0);
+	for(int i = 1; i < wc_numWorkers; ++i)
+		SDL_SemWait(wc_doneSem);
+}
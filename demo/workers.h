@@ -0,0 +1,19 @@
+#ifndef WORKERS_H_GUARD
+#define WORKERS_H_GUARD
+
+/* A job is called once for every work item handed to SR_RunJobs.
+   'worker' is the index of the calling thread, in [0, SR_NumWorkers()>,
+   so jobs can keep per-worker scratch data without locking. */
+typedef void (*SR_JobFunc)(int item, int worker, void* data);
+
+/* Starts the persistent worker threads. numThreads = 0 uses one per core.
+   The calling thread counts as worker 0. */
+void SR_InitWorkers(int numThreads);
+void SR_QuitWorkers();
+int SR_NumWorkers();
+
+/* Runs 'job' for every entry in items[0..numItems> and returns when all are done.
+   costs[i] is the estimated work of items[i]. The items are split into runs of
+   equal total cost, one per worker, and idle workers steal from the others. */
+void SR_RunJobs(SR_JobFunc job, void* data, const int* items, const int* costs, int numItems);
+#endif
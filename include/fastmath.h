@@ -0,0 +1,136 @@
+#ifndef FASTMATH_H_GUARD
+#define FASTMATH_H_GUARD
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Reciprocals and rounding without division or x87 code.
+   The integer reciprocals are seeded from a table, refined with Newton-Raphson
+   and corrected with the remainder, so they give the exact quotient of '/' */
+
+//1 / (1 + (i + 0.5) / 256), seeds for the reciprocal of a mantissa
+//starting with the 8 bits i. Filled in reci.cpp
+extern float wc_reciSeeds[256];
+
+/* Seed for 1/x, x > 0 and normal, good to about 9 bits */
+inline float ReciSeed(float x)
+{
+	union {
+		float f;
+		unsigned int i;
+	} u;
+	u.f = x;
+	const unsigned int e = u.i >> 23;
+	u.f = wc_reciSeeds[(u.i >> 15) & 0xFF];
+	//Divide the seed by the power of two of x
+	u.i -= (e - 127) << 23;
+	return u.f;
+}
+
+/* (1 << Base) / d, rounded toward zero like '/'. 0 when d is 0.
+   Base <= 30, so the quotient fits an int */
+template<int Base>
+inline int FixedReci(int d)
+{
+	if(!d)
+		return 0;
+	const long long n = 1LL << Base;
+	const long long ad = d < 0 ? -(long long)d : d;
+	const double x = (double)ad;
+	double r = ReciSeed((float)ad);
+	//9, 18, then 36 bits
+	r = r * (2.0 - x * r);
+	r = r * (2.0 - x * r);
+	long long q = (long long)((double)n * r);
+	const long long rem = n - q * ad;
+	if(rem < 0)
+		--q;
+	else if(rem >= ad)
+		++q;
+	return (int)(d < 0 ? -q : q);
+}
+
+/* 1/x, to within a few ulp */
+inline float FastReci(float x)
+{
+#ifdef __SSE2__
+	const __m128 v = _mm_set_ss(x);
+	__m128 r = _mm_rcp_ss(v);
+	r = _mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(2.0f), _mm_mul_ss(v, r)));
+	return _mm_cvtss_f32(r);
+#else
+	return 1.0f / x;
+#endif
+}
+
+/* Rounds to the nearest int, halfway cases to even like fistp does.
+   Without SSE, halfway cases go away from zero */
+inline int iround(float f)
+{
+#ifdef __SSE2__
+	return _mm_cvtss_si32(_mm_set_ss(f));
+#else
+	return (int)(f >= 0.0f ? f + 0.5f : f - 0.5f);
+#endif
+}
+
+#ifdef __SSE2__
+/* FixedReci for 4 values, Base <= 22. Everything the correction step
+   multiplies stays below 2^24, so it is exact in single precision */
+template<int Base>
+inline __m128i FixedReci4(__m128i d)
+{
+	const __m128 n = _mm_set1_ps((float)(1 << Base));
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128i sign = _mm_srai_epi32(d, 31);
+	const __m128i ad = _mm_sub_epi32(_mm_xor_si128(d, sign), sign);
+	const __m128 x = _mm_cvtepi32_ps(ad);
+	//12, then 23 bits
+	__m128 r = _mm_rcp_ps(x);
+	r = _mm_mul_ps(r, _mm_sub_ps(two, _mm_mul_ps(x, r)));
+	r = _mm_mul_ps(r, _mm_sub_ps(two, _mm_mul_ps(x, r)));
+	__m128i q = _mm_cvttps_epi32(_mm_mul_ps(n, r));
+	const __m128 rem = _mm_sub_ps(n, _mm_mul_ps(_mm_cvtepi32_ps(q), x));
+	//Masks are -1, so subtracting adds one
+	q = _mm_add_epi32(q, _mm_castps_si128(_mm_cmplt_ps(rem, _mm_setzero_ps())));
+	q = _mm_sub_epi32(q, _mm_castps_si128(_mm_cmpge_ps(rem, x)));
+	q = _mm_andnot_si128(_mm_cmpeq_epi32(ad, _mm_setzero_si128()), q);
+	return _mm_sub_epi32(_mm_xor_si128(q, sign), sign);
+}
+
+/* FastReci for 4 values */
+inline __m128 FastReci4(__m128 x)
+{
+	const __m128 r = _mm_rcp_ps(x);
+	return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, r)));
+}
+
+/* iround for 4 values */
+inline __m128i iround4(__m128 f)
+{
+	return _mm_cvtps_epi32(f);
+}
+#endif
+
+/* FixedReci of d[0..count>, 4 at a time where the precision allows it */
+template<int Base>
+inline void FixedReciBatch(const int* d, int* out, int count)
+{
+	int i = 0;
+#ifdef __SSE2__
+	if(Base <= 22) {
+		for(; i + 4 <= count; i += 4) {
+			const __m128i v = _mm_loadu_si128((const __m128i*)&d[i]);
+			_mm_storeu_si128((__m128i*)&out[i], FixedReci4<Base <= 22 ? Base : 22>(v));
+		}
+	}
+#endif
+	for(; i < count; ++i)
+		out[i] = FixedReci<Base>(d[i]);
+}
+
+/* (1 << 8) / val, (1 << 22) / val and (1 << 30) / val */
+int reci8(int val);
+int reci11(int val);
+int reci15(int val);
+#endif
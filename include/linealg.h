@@ -7,6 +7,7 @@
 #include "vector4.h"
 #include "matrix3.h"
 #include "matrix4.h"
+#include "fastmath.h"
 
 const float PI = 3.1415926535897932384626433832f;
 
@@ -495,21 +496,6 @@ inline VectorPOD4f project(const VectorPOD4f& v, float width, float height)
 
 
 
-/***********************************************************************
- ************** Assembly optimizations (Currently for x86)**************
- ********************************************************************* */
-inline int iround(float f)
-{
-	int r;
-
-	asm volatile ("fistpl %[output]\n"
-	              : [output] "=m" (r)
-	              : [input] "t" (f)
-	              : "st(0)");
-
-	return r;
-}
-
 inline int fpceil15(int fp)
 {
 	return (fp & 32767) ? ((fp & ~32767) + 32768) : fp;
@@ -519,10 +505,4 @@ inline int fpceil10(int fp)
 {
 	return (fp & 1023) ? ((fp & ~1023) + 1024) : fp;
 }
-
-
-/* NEW for X86, fix gcc bug. Reci computes 1/int */
-int reci15(int val);
-int reci8(int val);
-int reci11(int val);
 #endif